@@ -0,0 +1,257 @@
+/*
+ * Benchmarks for microtojson.h
+ *
+ * Every workload is generated repeatedly for about BENCH_SECONDS, the output
+ * is throughput in MB/s, time per field and, on x86, TSC cycles per byte.
+ * Build with 'make bench', pass BENCH_OPT=-Os to compare optimization levels.
+ */
+
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ * This file is Copyright (c) 2020 by Rene Kita
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "mtojson.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#ifndef BENCH_SECONDS
+#define BENCH_SECONDS 0.5
+#endif
+
+#define ARRAY_COUNT 4096
+#define STRING_COUNT 1024
+#define LONG_STRING_SIZE (64 * 1024)
+#define OBJECT_COUNT 1024
+
+struct record {
+	int id;
+	bool ok;
+	char name[12];
+};
+
+struct workload {
+	const char *name;
+	const struct json_kv *kv;
+	size_t fields;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned long long
+cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int
+run(const struct workload *w, char *buf, size_t len)
+{
+	size_t n = generate_json(buf, w->kv, len);
+	unsigned long iterations = 0;
+	unsigned long long c0, c1;
+	double t0, t1;
+
+	if (!n){
+		fprintf(stderr, "%s: generate_json failed\n", w->name);
+		return 1;
+	}
+
+	t0 = now();
+	c0 = cycles();
+	do {
+		for (int i = 0; i < 16; i++)
+			generate_json(buf, w->kv, len);
+		iterations += 16;
+		t1 = now();
+	} while (t1 - t0 < BENCH_SECONDS);
+	c1 = cycles();
+
+	double bytes = (double)n * (double)iterations;
+	double secs = t1 - t0;
+	printf("%-14s %9zu %10.1f %10.2f", w->name, n, bytes / secs / 1e6,
+			secs * 1e9 / ((double)w->fields * (double)iterations));
+#ifdef HAVE_TSC
+	printf(" %10.2f\n", (double)(c1 - c0) / bytes);
+#else
+	(void)c0;
+	(void)c1;
+	printf(" %10s\n", "-");
+#endif
+	return 0;
+}
+
+int
+main(void)
+{
+	// Flat object of mixed types
+	static const int i1 = -123456, i2 = 42;
+	static const unsigned u1 = 4000000000U;
+	static const bool b1 = true, b2 = false;
+	static const int64_t i64 = -9000000000000000000;
+	static const double d1 = 3.14159, d2 = -0.001;
+	static const struct json_kv flat[] = {
+		{ .key = "id",        .value = &i1,       .type = t_to_integer, },
+		{ .key = "count",     .value = &i2,       .type = t_to_integer, },
+		{ .key = "timestamp", .value = &u1,       .type = t_to_uinteger, },
+		{ .key = "valid",     .value = &b1,       .type = t_to_boolean, },
+		{ .key = "error",     .value = &b2,       .type = t_to_boolean, },
+		{ .key = "offset",    .value = &i64,      .type = t_to_int64, },
+		{ .key = "ratio",     .value = &d1,       .type = t_to_double, },
+		{ .key = "drift",     .value = &d2,       .type = t_to_double, },
+		{ .key = "name",      .value = "sensor-17", .type = t_to_string, },
+		{ .key = "unit",      .value = "celsius", .type = t_to_string, },
+		{ .key = "raw",       .value = "null",    .type = t_to_value, },
+		{ NULL },
+	};
+
+	// Objects nested as deep as possible, one integer each
+	static struct json_kv deep[MAX_NESTING_DEPTH][3];
+	for (int i = 0; i < MAX_NESTING_DEPTH; i++){
+		deep[i][0] = (struct json_kv){ .key = "level", .value = &i2,
+			.type = t_to_integer };
+		if (i < MAX_NESTING_DEPTH - 1)
+			deep[i][1] = (struct json_kv){ .key = "child",
+				.value = deep[i + 1], .type = t_to_object };
+	}
+
+	static int ints[ARRAY_COUNT];
+	for (int i = 0; i < ARRAY_COUNT; i++)
+		ints[i] = (i * 7919) % 2000003 - 1000000;
+	static const struct json_array jar_ints = {
+		.value = ints, .count = ARRAY_COUNT, .type = t_to_integer };
+	static const struct json_kv int_array[] = {
+		{ .key = "samples", .value = &jar_ints, .type = t_to_array, },
+		{ NULL },
+	};
+
+	static const char *strings[STRING_COUNT];
+	static const char *words[] = {"alpha", "beta", "gamma", "delta epsilon",
+		"zeta", "a somewhat longer log line"};
+	for (int i = 0; i < STRING_COUNT; i++)
+		strings[i] = words[i % 6];
+	static const struct json_array jar_strings = {
+		.value = strings, .count = STRING_COUNT, .type = t_to_string };
+	static const struct json_kv string_array[] = {
+		{ .key = "log", .value = &jar_strings, .type = t_to_array, },
+		{ NULL },
+	};
+
+	static char long_string[LONG_STRING_SIZE];
+	for (int i = 0; i < LONG_STRING_SIZE - 1; i++)
+		long_string[i] = (char)('a' + i % 26);
+	static const struct json_kv long_kv[] = {
+		{ .key = "blob", .value = long_string, .type = t_to_string, },
+		{ NULL },
+	};
+
+	// The same array of objects scattered on the heap and flattened
+	static int ids[OBJECT_COUNT];
+	static const struct json_kv *objects[OBJECT_COUNT];
+	for (int i = 0; i < OBJECT_COUNT; i++){
+		struct json_kv *o = calloc(4, sizeof(*o));
+		if (!o)
+			return 1;
+		ids[i] = i;
+		o[0] = (struct json_kv){ .key = "id", .value = &ids[i], .type = t_to_integer };
+		o[1] = (struct json_kv){ .key = "ok", .value = &b1, .type = t_to_boolean };
+		o[2] = (struct json_kv){ .key = "name", .value = words[i % 6], .type = t_to_string };
+		objects[i] = o;
+		free(malloc((size_t)(i % 7) * 64)); // Scatter them a little
+	}
+	static const struct json_array jar_objects = {
+		.value = objects, .count = OBJECT_COUNT, .type = t_to_object };
+	static const struct json_kv object_array[] = {
+		{ .key = "objects", .value = &jar_objects, .type = t_to_array, },
+		{ NULL },
+	};
+
+	static uint64_t arena[OBJECT_COUNT * 24];
+	struct json_builder b;
+	struct mtojson_ctx ctx = {0};
+	json_builder_init(&b, arena, sizeof(arena));
+	const struct json_kv *flattened = json_flatten(&ctx, &b, object_array);
+	if (!flattened)
+		return 1;
+
+	// The same objects as records read through field descriptors
+	static struct record records[OBJECT_COUNT];
+	for (int i = 0; i < OBJECT_COUNT; i++){
+		records[i].id = i;
+		records[i].ok = b1;
+		strcpy(records[i].name, words[i % 6]);
+	}
+	static const struct json_field record_fields[] = {
+		{ JSON_FIELD(struct record, id, t_to_integer), },
+		{ JSON_FIELD(struct record, ok, t_to_boolean), },
+		{ JSON_FIELD(struct record, name, t_to_string), },
+		{ NULL },
+	};
+	static const struct json_struct js_records = { .fields = record_fields,
+		.base = records, .stride = sizeof(records[0]) };
+	static const struct json_array jar_records = {
+		.value = &js_records, .count = OBJECT_COUNT, .type = t_to_struct };
+	static const struct json_kv record_array[] = {
+		{ .key = "objects", .value = &jar_records, .type = t_to_array, },
+		{ NULL },
+	};
+
+	// The same records once more, copied from a cache after the first time
+	static unsigned gen;
+	static char cache_buf[64 * OBJECT_COUNT];
+	static struct json_cache cache = { .value = &jar_records, .type = t_to_array,
+		.gen = &gen, .buf = cache_buf, .size = sizeof(cache_buf) };
+	static const struct json_kv cached[] = {
+		{ .key = "objects", .value = &cache, .type = t_to_cached, },
+		{ NULL },
+	};
+
+	const struct workload workloads[] = {
+		{ "flat",         flat,         11 },
+		{ "deep",         deep[0],      MAX_NESTING_DEPTH },
+		{ "int array",    int_array,    ARRAY_COUNT },
+		{ "string array", string_array, STRING_COUNT },
+		{ "long string",  long_kv,      1 },
+		{ "objects",      object_array, 4 * OBJECT_COUNT },
+		{ "flattened",    flattened,    4 * OBJECT_COUNT },
+		{ "records",      record_array, 4 * OBJECT_COUNT },
+		{ "cached",       cached,       4 * OBJECT_COUNT },
+	};
+
+	size_t len = 2 * LONG_STRING_SIZE;
+	char *buf = malloc(len);
+	if (!buf)
+		return 1;
+
+	int rv = 0;
+	printf("%-14s %9s %10s %10s %10s\n", "workload", "bytes", "MB/s",
+			"ns/field", "cycles/B");
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		rv |= run(&workloads[i], buf, len);
+
+	free(buf);
+	for (int i = 0; i < OBJECT_COUNT; i++)
+		free((void *)objects[i]);
+	return rv;
+}
@@ -0,0 +1,743 @@
+/*
+ * Differential fuzzer for microtojson.h and mfromjson.h
+ *
+ * Every input is turned into a random json_kv tree. Its JSON is generated with
+ * generate_json_r() as reference, once with the default and once with random
+ * output options, and every other output must give the same bytes:
+ * json_measure(), streaming, json_gen_next(), generate_json_iov(), templates,
+ * json_flatten(), generate_json_batch() and generate_json_parallel(). Every
+ * buffer length shorter than needed must fail without writing past it. The
+ * reference must parse back with json_parse(), and the input itself is parsed
+ * as JSON, which must not crash.
+ *
+ * The reference comes from the same engine as everything else, so only paths
+ * that disagree are found, not mistakes they share. Those are left to the
+ * hand written JSON of test_mtojson.c.
+ *
+ * 'make fuzz' builds it with MTOJSON_THREADS, MTOJSON_STATS and an
+ * MTOJSON_PARALLEL_MIN of 2, so even the small arrays here are split into
+ * chunks, and runs random inputs. Pass files to replay them, e.g. those
+ * written on a failure. Define FUZZ_LIBFUZZER and build with clang
+ * -fsanitize=fuzzer to get an entry point for libFuzzer, or feed the files of
+ * AFL to it.
+ */
+
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ * This file is Copyright (c) 2020 by Rene Kita
+ */
+
+#include "mfromjson.h"
+#include "mtojson.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef FUZZ_LIBFUZZER
+#include <getopt.h>
+#endif
+
+#define MAX_INPUT 1024
+#define MAX_MEMBERS 10
+#define MAX_ELEMENTS 12
+#define OUT_SIZE (64 * 1024)
+#define CANARY 16
+// Every length up to this is tried, beyond it only every seventh
+#define ALL_LENGTHS 1024
+
+struct fuzz {
+	const uint8_t *p;
+	size_t len;
+	struct json_builder b;
+	// Objects instead of caches, as reference
+	_Bool plain;
+	_Bool full;
+};
+
+struct sample {
+	int32_t a;
+	uint8_t b;
+	_Bool c;
+	double d;
+	char s[8];
+};
+
+static const struct json_field sample_fields[] = {
+	{ JSON_FIELD(struct sample, a, t_to_int32), },
+	{ JSON_FIELD(struct sample, b, t_to_uint8), },
+	{ JSON_FIELD(struct sample, c, t_to_boolean), },
+	{ JSON_FIELD(struct sample, d, t_to_double), },
+	{ JSON_FIELD(struct sample, s, t_to_string), },
+	{ NULL },
+};
+
+static const char *const raw_values[] = {
+	"0", "-1.5e3", "true", "null", "\"raw\"", "[1, 2]", "{\"a\": {}}",
+};
+
+static uint64_t arena[OUT_SIZE / 8];
+static uint64_t plain_arena[OUT_SIZE / 8];
+static uint64_t flat_arena[OUT_SIZE / 8];
+static char ref[OUT_SIZE];
+static char out[OUT_SIZE + CANARY];
+static char skel[OUT_SIZE];
+static struct json_slot slots[1024];
+static struct json_iovec iov[4096];
+static char scratch[OUT_SIZE];
+static char parse_buf[OUT_SIZE];
+#ifdef MTOJSON_THREADS
+static struct json_worker workers[4];
+#endif
+static unsigned cache_gen;
+
+static uint8_t
+next(struct fuzz *fz)
+{
+	if (!fz->len)
+		return 0;
+	fz->len--;
+	return *fz->p++;
+}
+
+static void*
+alloc(struct fuzz *fz, size_t size)
+{
+	void *p = json_builder_alloc(&fz->b, size);
+
+	fz->full |= !p;
+	return p;
+}
+
+static void
+fill(struct fuzz *fz, void *dst, size_t n)
+{
+	uint8_t *d = dst;
+
+	for (size_t i = 0; i < n; i++)
+		d[i] = next(fz);
+}
+
+// n bytes from the input, but never NUL
+static char*
+random_chars(struct fuzz *fz, size_t n)
+{
+	char *s = alloc(fz, n + 1);
+
+	if (!s)
+		return NULL;
+	for (size_t i = 0; i < n; i++)
+		s[i] = (char)(next(fz) | 1);
+	s[n] = '\0';
+	return s;
+}
+
+// Keys are written as they are, so only letters
+static char*
+random_key(struct fuzz *fz)
+{
+	size_t n = next(fz) % 8 + 1;
+	char *s = alloc(fz, n + 1);
+
+	if (!s)
+		return NULL;
+	for (size_t i = 0; i < n; i++)
+		s[i] = (char)('a' + next(fz) % 26);
+	s[n] = '\0';
+	return s;
+}
+
+static size_t
+scalar_size(enum json_value_type type)
+{
+	switch (type){
+	case t_to_boolean:
+		return sizeof(_Bool);
+	case t_to_integer:
+		return sizeof(int);
+	case t_to_uinteger:
+		return sizeof(unsigned);
+	case t_to_int8:
+	case t_to_uint8:
+		return 1;
+	case t_to_int16:
+	case t_to_uint16:
+		return 2;
+	case t_to_int32:
+	case t_to_uint32:
+		return 4;
+	case t_to_int64:
+	case t_to_uint64:
+		return 8;
+	case t_to_float:
+		return sizeof(float);
+	case t_to_double:
+		return sizeof(double);
+	default:
+		return 0;
+	}
+}
+
+static void
+random_sample(struct fuzz *fz, struct sample *s)
+{
+	fill(fz, &s->a, sizeof(s->a));
+	s->b = next(fz);
+	s->c = next(fz) & 1;
+	fill(fz, &s->d, sizeof(s->d));
+	size_t n = next(fz) % sizeof(s->s);
+	memset(s->s, 0, sizeof(s->s));
+	for (size_t i = 0; i < n; i++)
+		s->s[i] = (char)(next(fz) | 1);
+}
+
+static const struct json_kv *random_object(struct fuzz *fz, int depth);
+static const struct json_array *random_array(struct fuzz *fz, int depth);
+
+// Containers only while not nested deeper than the generator can go
+static enum json_value_type
+random_type(struct fuzz *fz, int depth)
+{
+	enum json_value_type type = next(fz) % (t_to_cached + 1);
+
+	if (depth > MAX_NESTING_DEPTH + 1 && (type == t_to_object
+	    || type == t_to_array || type == t_to_struct || type == t_to_cached))
+		return t_to_integer;
+	return type;
+}
+
+static const void*
+random_value(struct fuzz *fz, enum json_value_type type, int depth)
+{
+	size_t size = scalar_size(type);
+	void *p;
+
+	if (type == t_to_boolean){
+		_Bool *flag = alloc(fz, sizeof(*flag));
+		if (flag)
+			*flag = next(fz) & 1;
+		return flag;
+	}
+	if (size){
+		if ((p = alloc(fz, size)))
+			fill(fz, p, size);
+		return p;
+	}
+
+	switch (type){
+	case t_to_object:
+		return random_object(fz, depth + 1);
+	case t_to_array:
+		return random_array(fz, depth + 1);
+	case t_to_string:
+		return random_chars(fz, next(fz) % 24);
+	case t_to_value:
+		return raw_values[next(fz) % 7];
+	case t_to_strn:
+	case t_to_valuen:
+	case t_to_base64:
+	case t_to_hex: {
+		// json_str and json_bin are alike
+		struct json_str *str = alloc(fz, sizeof(*str));
+		if (!str)
+			return NULL;
+		if (type == t_to_valuen){
+			str->p = raw_values[next(fz) % 7];
+			str->len = strlen(str->p);
+		} else {
+			str->len = next(fz) % 24;
+			str->p = random_chars(fz, str->len);
+		}
+		return str->p ? str : NULL;
+	}
+	case t_to_struct: {
+		struct json_struct *js = alloc(fz, sizeof(*js));
+		struct sample *s = alloc(fz, sizeof(*s));
+		if (!js || !s)
+			return NULL;
+		random_sample(fz, s);
+		js->fields = sample_fields;
+		js->base = s;
+		js->stride = sizeof(*s);
+		return js;
+	}
+	case t_to_cached: {
+		size_t len = (size_t)next(fz) * 4;
+		if (fz->plain)
+			return random_object(fz, depth + 1);
+		struct json_cache *c = alloc(fz, sizeof(*c));
+		if (!c)
+			return NULL;
+		memset(c, 0, sizeof(*c));
+		c->type = t_to_object;
+		c->gen = &cache_gen;
+		c->size = len;
+		c->buf = alloc(fz, c->size + 1);
+		c->value = random_object(fz, depth + 1);
+		return c->buf && c->value ? c : NULL;
+	}
+	default:
+		return NULL;
+	}
+}
+
+static const struct json_array*
+random_array(struct fuzz *fz, int depth)
+{
+	struct json_array *jar = alloc(fz, sizeof(*jar));
+	enum json_value_type type = random_type(fz, depth);
+	size_t count = next(fz) % MAX_ELEMENTS;
+	size_t size = scalar_size(type);
+
+	if (!jar)
+		return NULL;
+	if (type == t_to_cached)
+		type = t_to_uint16;
+	jar->type = type;
+	jar->count = count;
+	jar->max = count;
+	if (type == t_to_struct){
+		struct json_struct *js = alloc(fz, sizeof(*js));
+		struct sample *s = alloc(fz, count * sizeof(*s) + 1);
+		if (!js || !s)
+			return NULL;
+		for (size_t i = 0; i < count; i++)
+			random_sample(fz, &s[i]);
+		js->fields = sample_fields;
+		js->base = s;
+		js->stride = sizeof(*s);
+		jar->value = js;
+		return jar;
+	}
+	if (type == t_to_null)
+		return jar;
+
+	// Numbers in place, headers of strings and binary data or pointers
+	_Bool header = type == t_to_strn || type == t_to_valuen
+		|| type == t_to_base64 || type == t_to_hex;
+	if (!size)
+		size = header ? sizeof(struct json_str) : sizeof(void *);
+	char *values = alloc(fz, count * size + 1);
+	if (!values)
+		return NULL;
+	jar->value = values;
+	if (scalar_size(type)){
+		fill(fz, values, count * size);
+		for (size_t i = 0; type == t_to_boolean && i < count; i++)
+			((_Bool *)values)[i] = values[i] & 1;
+		return jar;
+	}
+
+	for (size_t i = 0; i < count; i++){
+		const void *v = random_value(fz, type, depth);
+		if (!v)
+			return NULL;
+		if (header)
+			memcpy(values + i * size, v, size);
+		else
+			((const void **)(void *)values)[i] = v;
+	}
+	return jar;
+}
+
+static const struct json_kv*
+random_object(struct fuzz *fz, int depth)
+{
+	struct json_obj *obj = json_obj_new(&fz->b, next(fz) % MAX_MEMBERS);
+
+	fz->full |= !obj;
+	if (!obj)
+		return NULL;
+	while (obj->count < obj->max && fz->len){
+		enum json_value_type type = random_type(fz, depth);
+		char *key = random_key(fz);
+		const void *value = random_value(fz, type, depth);
+		uint8_t flags = next(fz);
+
+		if (fz->plain && type == t_to_cached)
+			type = t_to_object;
+		// The arena is full, what is there is enough
+		if (!key || (!value && type != t_to_null)
+		    || json_obj_add(obj, key, type, value))
+			break;
+
+		struct json_kv *kv = &obj->kv[obj->count - 1];
+		if (flags & 1)
+			kv->key_len = strlen(key);
+		if ((flags & 6) == 6){
+			_Bool *present = alloc(fz, sizeof(*present));
+			if (!present)
+				break;
+			*present = flags >> 3 & 1;
+			kv->present = present;
+		}
+	}
+	return obj->kv;
+}
+
+static int
+report(const char *what, size_t len)
+{
+	fprintf(stderr, "fuzz: %s differs, reference length %zu\n", what, len);
+	return 1;
+}
+
+static int
+flush_append(struct mtojson_ctx *ctx, const char *buf, size_t len)
+{
+	size_t *pos = ctx->user;
+
+	if (*pos + len > OUT_SIZE)
+		return 1;
+	memcpy(out + *pos, buf, len);
+	*pos += len;
+	return 0;
+}
+
+// Shorter buffers must fail and leave everything after them alone
+static int
+check_lengths(struct mtojson_ctx *ctx, const struct json_kv *kv, size_t len)
+{
+	for (size_t n = 0; n <= len; n += n < ALL_LENGTHS ? 1 : 7){
+		memset(out, 0xa5, n + CANARY);
+		if (generate_json_r(ctx, out, kv, n))
+			return report("truncated buffer", len);
+		for (size_t i = n; i < n + CANARY; i++)
+			if ((uint8_t)out[i] != 0xa5)
+				return report("overrun", len);
+	}
+	return 0;
+}
+
+static int
+check_stream(struct mtojson_ctx *ctx, const struct json_kv *kv, size_t len,
+		size_t chunk)
+{
+	char buf[64];
+	size_t pos = 0;
+
+	ctx->user = &pos;
+	if (generate_json_stream(ctx, kv, buf, chunk, flush_append) != len
+	    || pos != len || memcmp(out, ref, len))
+		return report("stream", len);
+	return 0;
+}
+
+static int
+check_pieces(struct mtojson_ctx *ctx, const struct json_kv *kv, size_t len,
+		size_t piece)
+{
+	size_t pos = 0, n;
+
+	json_gen_begin(ctx, kv);
+	do {
+		n = json_gen_next(ctx, out + pos, piece);
+		pos += n;
+	} while (n == piece && pos + piece <= OUT_SIZE);
+	if (pos != len || memcmp(out, ref, len))
+		return report("json_gen_next", len);
+	return 0;
+}
+
+static int
+check_iov(struct mtojson_ctx *ctx, const struct json_kv *kv, size_t len,
+		size_t threshold)
+{
+	size_t n = generate_json_iov(ctx, kv, scratch, sizeof(scratch), iov,
+			sizeof(iov) / sizeof(iov[0]), threshold);
+	size_t pos = 0;
+
+	if (!n && ctx->error == e_json_no_space)
+		return 0;
+	for (size_t i = 0; i < n && pos + iov[i].iov_len <= OUT_SIZE; i++){
+		memcpy(out + pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	if (!n || pos != len || memcmp(out, ref, len))
+		return report("generate_json_iov", len);
+	return 0;
+}
+
+/*
+ * All outputs of kv with the options of ctx against the buffer output of
+ * plain, which has objects instead of caches. Returns the reference length
+ * through len.
+ */
+static int
+check_outputs(struct mtojson_ctx *ctx, const struct json_kv *kv,
+		const struct json_kv *plain, size_t piece, size_t *ref_len)
+{
+	size_t len = generate_json_r(ctx, ref, plain, sizeof(ref));
+
+	*ref_len = len;
+	if (!len && ctx->error == e_json_no_space)
+		return 0;
+	if (json_measure_r(ctx, kv) != (len ? len + 1 : 0))
+		return report("json_measure", len);
+	if (!len)
+		return 0;
+	if (check_lengths(ctx, kv, len))
+		return 1;
+
+	memset(out, 0xa5, len + 1 + CANARY);
+	if (generate_json_r(ctx, out, kv, len + 1) != len || strcmp(out, ref)
+	    || (uint8_t)out[len + 1] != 0xa5)
+		return report("exact buffer", len);
+	return check_stream(ctx, kv, len, piece)
+		|| check_pieces(ctx, kv, len, piece)
+		|| check_iov(ctx, kv, len, piece % 8);
+}
+
+#ifdef MTOJSON_THREADS
+/*
+ * Build with a small MTOJSON_PARALLEL_MIN to have the arrays split, into up
+ * to four chunks. With MTOJSON_STATS they must add up to the serial ones.
+ */
+static int
+check_parallel(struct mtojson_ctx *ctx, const struct json_kv *kv, size_t len)
+{
+	unsigned n = (unsigned)(len % 4) + 1;
+
+	memset(out, 0xa5, len + CANARY);
+	if (generate_json_parallel(ctx, out, kv, len, workers, n)
+	    || (uint8_t)out[len] != 0xa5)
+		return report("generate_json_parallel, short buffer", len);
+
+#ifdef MTOJSON_STATS
+	// Generated once, caches are only copied from now on
+	struct json_stats stats;
+	generate_json_r(ctx, out, kv, len + 1);
+	generate_json_r(ctx, out, kv, len + 1);
+	stats = ctx->stats;
+#endif
+	if (generate_json_parallel(ctx, out, kv, len + 1, workers, n) != len
+	    || strcmp(out, ref))
+		return report("generate_json_parallel", len);
+#ifdef MTOJSON_STATS
+	if (memcmp(ctx->stats.bytes, stats.bytes, sizeof(stats.bytes))
+	    || ctx->stats.fields != stats.fields
+	    || ctx->stats.peak_depth != stats.peak_depth)
+		return report("generate_json_parallel, stats", len);
+#endif
+	return 0;
+}
+#endif
+
+/*
+ * The other ways to generate kv, with the output options of opts. ref holds
+ * its JSON of length len.
+ */
+static int
+check_others(const struct mtojson_ctx *opts, const struct json_kv *kv,
+		size_t len)
+{
+	struct mtojson_ctx ctx = { .compact = opts->compact, .indent = opts->indent };
+	struct json_template tpl = { .skel = skel, .skel_len = sizeof(skel),
+		.slots = slots, .max_slots = sizeof(slots) / sizeof(slots[0]) };
+	const struct json_kv *records[] = { kv };
+	struct json_builder fb;
+	struct mfromjson_ctx pctx;
+	static const struct json_kv skip[] = {{ NULL }};
+
+	if (json_template_compile(&ctx, &tpl, kv)
+	    && (json_template_render(&ctx, &tpl, out, len + 1) != len || strcmp(out, ref)))
+		return report("json_template_render", len);
+
+	json_builder_init(&fb, flat_arena, sizeof(flat_arena));
+	const struct json_kv *flat = json_flatten(&ctx, &fb, kv);
+	if (flat && (generate_json_r(&ctx, out, flat, len + 1) != len || strcmp(out, ref)))
+		return report("json_flatten", len);
+
+	// Newline delimited records are never indented
+	struct mtojson_ctx lctx = { .compact = ctx.compact };
+	size_t line = generate_json_r(&lctx, scratch, kv, sizeof(scratch));
+	if (line && (generate_json_batch_r(&ctx, out, records, 1, line + 2,
+	                                   m_json_ndjson) != 1
+	             || memcmp(out, scratch, line) || strcmp(out + line, "\n")))
+		return report("generate_json_batch", len);
+	if (!ctx.indent && line != len)
+		return report("generate_json_batch, line", len);
+
+#ifdef MTOJSON_THREADS
+	if (check_parallel(&ctx, kv, len))
+		return 1;
+#endif
+
+	// The JSON must be valid, everything is skipped
+	memcpy(parse_buf, ref, len);
+	if (json_parse(&pctx, parse_buf, len, skip) != len)
+		return report("json_parse", len);
+	return 0;
+}
+
+// Parse the input itself, which only must not crash or overrun
+static void
+parse_input(const uint8_t *data, size_t size)
+{
+	static int ints[4];
+	static struct json_str str, raw;
+	static const char *names[4];
+	static struct sample s;
+	static int64_t i64;
+	static double d;
+	static _Bool b, has_b;
+	static struct json_array jar_ints = { .value = ints, .type = t_to_integer,
+		.max = 4 };
+	static struct json_array jar_names = { .value = names, .type = t_to_string,
+		.max = 4 };
+	static const struct json_struct js = { .fields = sample_fields, .base = &s };
+	static const struct json_kv inner[] = {
+		{ .key = "i", .value = &i64, .type = t_to_int64, },
+		{ .key = "raw", .value = &raw, .type = t_to_valuen, },
+		{ NULL },
+	};
+	static const struct json_kv kv[] = {
+		{ .key = "a", .value = &jar_ints, .type = t_to_array, },
+		{ .key = "s", .value = &str, .type = t_to_strn, },
+		{ .key = "n", .value = &jar_names, .type = t_to_array, },
+		{ .key = "o", .value = inner, .type = t_to_object, },
+		{ .key = "t", .value = &js, .type = t_to_struct, },
+		{ .key = "d", .value = &d, .type = t_to_double, },
+		{ .key = "b", .value = &b, .type = t_to_boolean, .present = &has_b, },
+		{ NULL },
+	};
+	struct mfromjson_ctx ctx;
+
+	memcpy(parse_buf, data, size);
+	if (json_parse(&ctx, parse_buf, size, kv) > size)
+		abort();
+}
+
+// Trees checked and the bytes of their reference JSON
+static unsigned long checked;
+static unsigned long long checked_bytes;
+
+static int
+fuzz_one(const uint8_t *data, size_t size)
+{
+	struct fuzz fz = { .p = data, .len = size };
+	uint8_t opts = next(&fz);
+	size_t piece = next(&fz) % 63 + 1;
+
+	if (size > MAX_INPUT)
+		return 0;
+	parse_input(data, size);
+
+	// The same tree twice from the same bytes, once without caches
+	struct fuzz pfz = fz;
+	pfz.plain = 1;
+	json_builder_init(&fz.b, arena, sizeof(arena));
+	json_builder_init(&pfz.b, plain_arena, sizeof(plain_arena));
+	const struct json_kv *kv = random_object(&fz, 1);
+	const struct json_kv *plain = random_object(&pfz, 1);
+	if (!kv || !plain || fz.full || pfz.full)
+		return 0;
+
+	struct mtojson_ctx ctx = {0};
+	size_t len;
+	if (check_outputs(&ctx, kv, plain, piece, &len)
+	    || (len && check_others(&ctx, kv, len)))
+		return 1;
+	checked += len != 0;
+	checked_bytes += len;
+
+	// Caches are filled now, a new generation generates them again
+	cache_gen += opts & 1;
+	ctx.compact = opts >> 1 & 1;
+	ctx.indent = opts >> 2 & 3;
+	return check_outputs(&ctx, kv, plain, piece, &len)
+		|| (len && check_others(&ctx, kv, len));
+}
+
+#ifdef FUZZ_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (fuzz_one(data, size))
+		abort();
+	return 0;
+}
+#else
+static uint64_t
+xorshift(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void
+save_input(const uint8_t *data, size_t size)
+{
+	FILE *f = fopen("fuzz_failure.bin", "wb");
+
+	if (!f)
+		return;
+	fwrite(data, 1, size, f);
+	fclose(f);
+	fputs("fuzz: input written to fuzz_failure.bin\n", stderr);
+}
+
+static int
+replay(const char *path)
+{
+	static uint8_t data[MAX_INPUT];
+	FILE *f = fopen(path, "rb");
+	size_t size;
+
+	if (!f){
+		perror(path);
+		return 1;
+	}
+	size = fread(data, 1, sizeof(data), f);
+	fclose(f);
+	return fuzz_one(data, size);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static uint8_t data[MAX_INPUT];
+	unsigned long iterations = 10000;
+	uint64_t state = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hn:s:")) != -1){
+		switch (opt){
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 'h':
+		default:
+			fputs("usage: fuzz_mtojson [-n iterations] [-s seed] [file...]\n", stderr);
+			return 1;
+		}
+	}
+
+	if (optind < argc){
+		int rv = 0;
+		for (int i = optind; i < argc; i++)
+			rv |= replay(argv[i]);
+		return rv;
+	}
+
+	for (unsigned long k = 0; k < iterations; k++){
+		size_t size = xorshift(&state) % sizeof(data);
+		for (size_t i = 0; i < size; i++)
+			data[i] = (uint8_t)xorshift(&state);
+		if (fuzz_one(data, size)){
+			save_input(data, size);
+			return 1;
+		}
+	}
+	printf("fuzz: %lu inputs OK, %lu trees of %llu bytes JSON\n", iterations,
+			checked, checked_bytes);
+	return 0;
+}
+#endif
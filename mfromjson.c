@@ -0,0 +1,700 @@
+/*
+   SPDX-License-Identifier: BSD-2-Clause
+   This file is Copyright (c) 2020 by Rene Kita
+*/
+
+#include "mfromjson.h"
+
+#include <float.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+// Record the first error and where it happened, always returns 0
+static NOINLINE _Bool
+fail(struct mfromjson_ctx *ctx, enum json_parse_error error)
+{
+	if (!ctx->error){
+		ctx->error = error;
+		ctx->pos = (size_t)(ctx->p - ctx->in);
+	}
+	return 0;
+}
+
+static char
+peek(const struct mfromjson_ctx *ctx)
+{
+	return ctx->p < ctx->end ? *ctx->p : '\0';
+}
+
+static void
+skip_ws(struct mfromjson_ctx *ctx)
+{
+	while (ctx->p < ctx->end && (*ctx->p == ' ' || *ctx->p == '\t'
+	       || *ctx->p == '\n' || *ctx->p == '\r'))
+		ctx->p++;
+}
+
+static int
+hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// The four hex digits at s, or -1
+static long
+hex4(const char *s)
+{
+	long cp = 0;
+
+	for (int i = 0; i < 4; i++){
+		int d = hex_digit(s[i]);
+		if (d < 0)
+			return -1;
+		cp = cp << 4 | d;
+	}
+	return cp;
+}
+
+/*
+ * Return the closing quote of the string starting at s, after the opening
+ * one. Escapes are checked but left as they are.
+ */
+static NOINLINE char*
+string_end(struct mfromjson_ctx *ctx, char *s)
+{
+	for (; s < ctx->end && *s != '"'; s++){
+		if ((unsigned char)*s < 0x20)
+			break;
+		if (*s != '\\')
+			continue;
+		if (++s == ctx->end)
+			break;
+		if (*s == 'u' && (ctx->end - s < 5 || hex4(s + 1) < 0))
+			break;
+		if (*s == 'u')
+			s += 4;
+		else if (!*s || !strchr("\"\\/bfnrt", *s))
+			break;
+	}
+	if (s < ctx->end && *s == '"')
+		return s;
+	ctx->p = s;
+	fail(ctx, e_parse_syntax);
+	return NULL;
+}
+
+static char*
+put_utf8(char *w, long cp)
+{
+	if (cp < 0x80){
+		*w++ = (char)cp;
+	} else if (cp < 0x800){
+		*w++ = (char)(0xc0 | cp >> 6);
+		*w++ = (char)(0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000){
+		*w++ = (char)(0xe0 | cp >> 12);
+		*w++ = (char)(0x80 | (cp >> 6 & 0x3f));
+		*w++ = (char)(0x80 | (cp & 0x3f));
+	} else {
+		*w++ = (char)(0xf0 | cp >> 18);
+		*w++ = (char)(0x80 | (cp >> 12 & 0x3f));
+		*w++ = (char)(0x80 | (cp >> 6 & 0x3f));
+		*w++ = (char)(0x80 | (cp & 0x3f));
+	}
+	return w;
+}
+
+/*
+ * The code point of the \u escape at *s, which is moved past it. Surrogate
+ * pairs are combined, a lone surrogate becomes U+FFFD.
+ */
+static long
+code_point(const char **s, const char *q)
+{
+	long cp = hex4(*s);
+	long lo;
+
+	*s += 4;
+	if (cp < 0xd800 || cp > 0xdfff)
+		return cp;
+	if (cp < 0xdc00 && q - *s >= 6 && (*s)[0] == '\\' && (*s)[1] == 'u'
+	    && (lo = hex4(*s + 2)) >= 0xdc00 && lo <= 0xdfff){
+		*s += 6;
+		return 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+	}
+	return 0xfffd;
+}
+
+/*
+ * Unescape the checked string from s up to the closing quote q in place and
+ * return its end. Nothing gets longer, so it never passes q.
+ */
+static NOINLINE char*
+unescape(char *s, const char *q)
+{
+	static const char plain[] = "\"\\/\b\f\n\r\t";
+	static const char escape[] = "\"\\/bfnrt";
+	const char *r = memchr(s, '\\', (size_t)(q - s));
+	char *w;
+
+	if (!r)
+		return (char *)(uintptr_t)q;
+	w = s + (r - s);
+	while (r < q){
+		if (*r != '\\'){
+			*w++ = *r++;
+		} else if (*++r == 'u'){
+			r++;
+			w = put_utf8(w, code_point(&r, q));
+		} else {
+			*w++ = plain[strchr(escape, *r++) - escape];
+		}
+	}
+	return w;
+}
+
+static char*
+digits(char *p, const char *end)
+{
+	while (p < end && *p >= '0' && *p <= '9')
+		p++;
+	return p;
+}
+
+// Check the number at s and return its end, *integer tells if it is one
+static NOINLINE char*
+number_end(struct mfromjson_ctx *ctx, char *s, _Bool *integer)
+{
+	char *p = s + (*s == '-');
+	char *e;
+
+	*integer = 1;
+	if (p == ctx->end || *p < '0' || *p > '9')
+		goto err;
+	e = *p == '0' ? p + 1 : digits(p, ctx->end);
+	if (e < ctx->end && *e == '.'){
+		*integer = 0;
+		p = e + 1;
+		if ((e = digits(p, ctx->end)) == p)
+			goto err;
+	}
+	if (e < ctx->end && (*e == 'e' || *e == 'E')){
+		*integer = 0;
+		p = e + 1;
+		if (p < ctx->end && (*p == '+' || *p == '-'))
+			p++;
+		if ((e = digits(p, ctx->end)) == p)
+			goto err;
+	}
+	return e;
+err:
+	ctx->p = p;
+	fail(ctx, e_parse_syntax);
+	return NULL;
+}
+
+static NOINLINE _Bool
+store_signed(struct mfromjson_ctx *ctx, int64_t v)
+{
+	void *dst = ctx->dst;
+
+	switch (ctx->type){
+	case t_to_integer:
+		if (v < INT_MIN || v > INT_MAX)
+			break;
+		*(int *)dst = (int)v;
+		return 1;
+	case t_to_int8:
+		if (v < INT8_MIN || v > INT8_MAX)
+			break;
+		*(int8_t *)dst = (int8_t)v;
+		return 1;
+	case t_to_int16:
+		if (v < INT16_MIN || v > INT16_MAX)
+			break;
+		*(int16_t *)dst = (int16_t)v;
+		return 1;
+	case t_to_int32:
+		if (v < INT32_MIN || v > INT32_MAX)
+			break;
+		*(int32_t *)dst = (int32_t)v;
+		return 1;
+	default:
+		*(int64_t *)dst = v;
+		return 1;
+	}
+	return fail(ctx, e_parse_range);
+}
+
+static NOINLINE _Bool
+store_unsigned(struct mfromjson_ctx *ctx, uint64_t v)
+{
+	void *dst = ctx->dst;
+
+	switch (ctx->type){
+	case t_to_uinteger:
+		if (v > UINT_MAX)
+			break;
+		*(unsigned *)dst = (unsigned)v;
+		return 1;
+	case t_to_uint8:
+		if (v > UINT8_MAX)
+			break;
+		*(uint8_t *)dst = (uint8_t)v;
+		return 1;
+	case t_to_uint16:
+		if (v > UINT16_MAX)
+			break;
+		*(uint16_t *)dst = (uint16_t)v;
+		return 1;
+	case t_to_uint32:
+		if (v > UINT32_MAX)
+			break;
+		*(uint32_t *)dst = (uint32_t)v;
+		return 1;
+	default:
+		*(uint64_t *)dst = v;
+		return 1;
+	}
+	return fail(ctx, e_parse_range);
+}
+
+static _Bool
+is_signed(enum json_value_type type)
+{
+	return type == t_to_integer || (type >= t_to_int8 && type <= t_to_int64);
+}
+
+static _Bool
+is_unsigned(enum json_value_type type)
+{
+	return type == t_to_uinteger || (type >= t_to_uint8 && type <= t_to_uint64);
+}
+
+// The checked integer from s to e into an integer of any size
+static NOINLINE _Bool
+read_int(struct mfromjson_ctx *ctx, const char *s, const char *e)
+{
+	_Bool neg = *s == '-';
+	uint64_t n = 0;
+
+	for (s += neg; s < e; s++){
+		unsigned d = (unsigned)(*s - '0');
+		if (n > (UINT64_MAX - d) / 10)
+			return fail(ctx, e_parse_range);
+		n = n * 10 + d;
+	}
+
+	if (is_unsigned(ctx->type)){
+		if (neg && n)
+			return fail(ctx, e_parse_range);
+		return store_unsigned(ctx, n);
+	}
+	if (n > (uint64_t)INT64_MAX + neg)
+		return fail(ctx, e_parse_range);
+	return store_signed(ctx, neg && n ? -(int64_t)(n - 1) - 1 : (int64_t)n);
+}
+
+// The checked number from s to e into a float or double via ctx->num
+static NOINLINE _Bool
+read_float(struct mfromjson_ctx *ctx, const char *s, const char *e)
+{
+	size_t len = (size_t)(e - s);
+	double d;
+
+	if (len >= sizeof(ctx->num))
+		return fail(ctx, e_parse_range);
+	memcpy(ctx->num, s, len);
+	ctx->num[len] = '\0';
+	d = strtod(ctx->num, NULL);
+
+	if (ctx->type == t_to_float){
+		if (d > FLT_MAX || d < -FLT_MAX)
+			return fail(ctx, e_parse_range);
+		*(float *)ctx->dst = (float)d;
+		return 1;
+	}
+	if (d > DBL_MAX || d < -DBL_MAX)
+		return fail(ctx, e_parse_range);
+	*(double *)ctx->dst = d;
+	return 1;
+}
+
+static NOINLINE _Bool
+read_number(struct mfromjson_ctx *ctx)
+{
+	char *s = ctx->p;
+	_Bool integer;
+	char *e = number_end(ctx, s, &integer);
+
+	if (!e)
+		return 0;
+	if (ctx->type != t_to_valuen && ctx->type != t_to_float
+	    && ctx->type != t_to_double && (!integer
+	    || (!is_signed(ctx->type) && !is_unsigned(ctx->type))))
+		return fail(ctx, e_parse_type);
+
+	ctx->p = e;
+	if (ctx->type == t_to_valuen)
+		return 1;
+	if (ctx->type == t_to_float || ctx->type == t_to_double)
+		return read_float(ctx, s, e);
+	return read_int(ctx, s, e);
+}
+
+/*
+ * A string into a json_str, a char array of ctx->size or, with a size of 0,
+ * NUL terminated in place for a char pointer. Only a json_str may hold \u0000.
+ */
+static NOINLINE _Bool
+read_string(struct mfromjson_ctx *ctx)
+{
+	char *s = ctx->p + 1;
+	char *q = string_end(ctx, s);
+	char *w;
+
+	if (!q)
+		return 0;
+	if (ctx->type != t_to_valuen && ctx->type != t_to_strn
+	    && ctx->type != t_to_string)
+		return fail(ctx, e_parse_type);
+
+	ctx->p = q + 1;
+	if (ctx->type == t_to_valuen)
+		return 1;
+	w = unescape(s, q);
+	if (ctx->type == t_to_strn){
+		struct json_str *str = ctx->dst;
+		str->p = s;
+		str->len = (size_t)(w - s);
+		return 1;
+	}
+
+	// An escaped NUL would cut the C string short
+	if (memchr(s, '\0', (size_t)(w - s))){
+		ctx->p = s - 1;
+		return fail(ctx, e_parse_range);
+	}
+	if (!ctx->size){
+		*w = '\0';
+		*(const char **)ctx->dst = s;
+	} else if ((size_t)(w - s) < ctx->size){
+		memcpy(ctx->dst, s, (size_t)(w - s));
+		((char *)ctx->dst)[w - s] = '\0';
+	} else {
+		return fail(ctx, e_parse_range);
+	}
+	return 1;
+}
+
+// true, false or null
+static NOINLINE _Bool
+read_literal(struct mfromjson_ctx *ctx)
+{
+	static const char *const words[] = {"true", "false", "null"};
+	int i = *ctx->p == 't' ? 0 : *ctx->p == 'f' ? 1 : 2;
+	size_t len = strlen(words[i]);
+
+	if ((size_t)(ctx->end - ctx->p) < len || memcmp(ctx->p, words[i], len))
+		return fail(ctx, e_parse_syntax);
+
+	// null leaves out members that can be absent
+	if (i < 2 && ctx->type == t_to_boolean)
+		*(_Bool *)ctx->dst = i == 0;
+	else if (i == 2 && ctx->present)
+		*ctx->present = 0;
+	else if (ctx->type != t_to_valuen && (i < 2 || ctx->type != t_to_null))
+		return fail(ctx, e_parse_type);
+	ctx->p += len;
+	return 1;
+}
+
+/*
+ * Open the object, struct or array of the current value. Without a descriptor
+ * the value is only skipped, and kept as raw JSON if there is a json_str.
+ */
+static NOINLINE _Bool
+push_frame(struct mfromjson_ctx *ctx, enum json_value_type type)
+{
+	if (ctx->depth == MAX_NESTING_DEPTH)
+		return fail(ctx, e_parse_depth);
+
+	struct json_parse_frame *f = &ctx->stack[ctx->depth++];
+	f->type = type;
+	f->desc = ctx->desc;
+	f->base = ctx->dst;
+	f->start = ctx->p++;
+	f->i = 0;
+	if (type == t_to_object && f->desc)
+		for (const struct json_kv *kv = f->desc; kv->key; kv++)
+			if (kv->present)
+				*(_Bool *)(uintptr_t)kv->present = 0;
+	return 1;
+}
+
+static _Bool
+read_value(struct mfromjson_ctx *ctx)
+{
+	char c = peek(ctx);
+	enum json_value_type type = ctx->type;
+
+	if (type == t_to_valuen)
+		ctx->desc = NULL;
+	if (c == '{' && (type == t_to_object || type == t_to_valuen))
+		return push_frame(ctx, t_to_object);
+	if (c == '{' && type == t_to_struct)
+		return push_frame(ctx, t_to_struct);
+	if (c == '[' && (type == t_to_array || type == t_to_valuen))
+		return push_frame(ctx, t_to_array);
+	if (c == '{' || c == '[')
+		return fail(ctx, e_parse_type);
+	if (c == '"')
+		return read_string(ctx);
+	if (c == 't' || c == 'f' || c == 'n')
+		return read_literal(ctx);
+	if (c == '-' || (c >= '0' && c <= '9'))
+		return read_number(ctx);
+	return fail(ctx, e_parse_syntax);
+}
+
+// Read the current value, scalars of t_to_valuen are kept as they are
+static NOINLINE _Bool
+parse_value(struct mfromjson_ctx *ctx)
+{
+	skip_ws(ctx);
+	char *start = ctx->p;
+	int depth = ctx->depth;
+
+	if (!read_value(ctx))
+		return 0;
+	if (ctx->type == t_to_valuen && ctx->dst && ctx->depth == depth){
+		struct json_str *raw = ctx->dst;
+		raw->p = start;
+		raw->len = (size_t)(ctx->p - start);
+	}
+	return 1;
+}
+
+// Set up the member key of the object or struct of f as next value
+static NOINLINE _Bool
+member_target(struct mfromjson_ctx *ctx, const struct json_parse_frame *f,
+		const char *key, size_t len)
+{
+	if (f->type == t_to_struct){
+		const struct json_field *field = f->desc;
+		for (; field->key; field++)
+			if (field->key_len == len && !memcmp(field->key, key, len))
+				break;
+		if (!field->key)
+			return 1;
+		// Arrays are json_array members of the struct
+		ctx->type = field->type;
+		ctx->dst = f->base + field->offset;
+		ctx->desc = field->type == t_to_struct ? field->fields : ctx->dst;
+		ctx->size = field->size;
+		return 1;
+	}
+
+	const struct json_kv *kv = f->desc;
+	for (; kv && kv->key; kv++)
+		if ((kv->key_len ? kv->key_len : strlen(kv->key)) == len
+		    && !memcmp(kv->key, key, len))
+			break;
+	if (!kv || !kv->key)
+		return 1;
+	if (kv->type == t_to_string)
+		return fail(ctx, e_parse_type);
+
+	ctx->type = kv->type;
+	ctx->dst = (void *)(uintptr_t)kv->value;
+	ctx->desc = kv->value;
+	ctx->present = (_Bool *)(uintptr_t)kv->present;
+	if (ctx->present)
+		*ctx->present = 1;
+	if (kv->type == t_to_struct){
+		const struct json_struct *js = kv->value;
+		ctx->desc = js->fields;
+		ctx->dst = (void *)(uintptr_t)js->base;
+	}
+	return 1;
+}
+
+// Read the key and colon of the next member
+static NOINLINE _Bool
+read_key(struct mfromjson_ctx *ctx, const struct json_parse_frame *f)
+{
+	char *key = ctx->p + 1;
+	char *q;
+
+	if (peek(ctx) != '"')
+		return fail(ctx, e_parse_syntax);
+	if (!(q = string_end(ctx, key)))
+		return 0;
+	ctx->p = q + 1;
+	skip_ws(ctx);
+	if (peek(ctx) != ':')
+		return fail(ctx, e_parse_syntax);
+	ctx->p++;
+	return member_target(ctx, f, key, (size_t)(q - key));
+}
+
+static size_t
+elem_size(enum json_value_type type)
+{
+	switch (type){
+	case t_to_boolean:
+		return sizeof(_Bool);
+	case t_to_integer:
+		return sizeof(int);
+	case t_to_uinteger:
+		return sizeof(unsigned);
+	case t_to_int8:
+	case t_to_uint8:
+		return sizeof(int8_t);
+	case t_to_int16:
+	case t_to_uint16:
+		return sizeof(int16_t);
+	case t_to_int32:
+	case t_to_uint32:
+		return sizeof(int32_t);
+	case t_to_int64:
+	case t_to_uint64:
+		return sizeof(int64_t);
+	case t_to_float:
+		return sizeof(float);
+	case t_to_double:
+		return sizeof(double);
+	case t_to_strn:
+	case t_to_valuen:
+		return sizeof(struct json_str);
+	case t_to_null:
+		return 0;
+	default:
+		return sizeof(void *);
+	}
+}
+
+// Set up the next element of the array of f, if there is room for it
+static NOINLINE _Bool
+element_target(struct mfromjson_ctx *ctx, const struct json_parse_frame *f)
+{
+	const struct json_array *jar = f->desc;
+	char *value = (char *)(uintptr_t)jar->value;
+
+	if (f->i == jar->max)
+		return fail(ctx, e_parse_space);
+	ctx->type = jar->type;
+	ctx->size = 0;
+	if (jar->type == t_to_struct){
+		const struct json_struct *js = jar->value;
+		ctx->desc = js->fields;
+		ctx->dst = (char *)(uintptr_t)js->base + f->i * js->stride;
+	} else if (jar->type == t_to_object || jar->type == t_to_array){
+		ctx->desc = ((const void *const *)jar->value)[f->i];
+	} else {
+		ctx->dst = value + f->i * elem_size(jar->type);
+	}
+	return 1;
+}
+
+static NOINLINE void
+pop_frame(struct mfromjson_ctx *ctx, struct json_parse_frame *f)
+{
+	ctx->p++;
+	ctx->depth--;
+	if (f->type == t_to_array && f->desc)
+		((struct json_array *)(uintptr_t)f->desc)->count = f->i;
+	if (!f->desc && f->base){
+		struct json_str *raw = (struct json_str *)(void *)f->base;
+		raw->p = f->start;
+		raw->len = (size_t)(ctx->p - f->start);
+	}
+}
+
+/*
+ * After a value or an opening bracket, close the innermost object or array
+ * or read its next member or element.
+ */
+static _Bool
+parse_next(struct mfromjson_ctx *ctx)
+{
+	struct json_parse_frame *f = &ctx->stack[ctx->depth - 1];
+	char c;
+
+	skip_ws(ctx);
+	c = peek(ctx);
+	if (c == (f->type == t_to_array ? ']' : '}')){
+		pop_frame(ctx, f);
+		return 1;
+	}
+	if (f->i && c != ',')
+		return fail(ctx, e_parse_syntax);
+	if (f->i)
+		ctx->p++;
+	skip_ws(ctx);
+
+	// Anything not in a descriptor is skipped
+	ctx->type = t_to_valuen;
+	ctx->dst = NULL;
+	ctx->size = 0;
+	ctx->present = NULL;
+	if (f->type != t_to_array && !read_key(ctx, f))
+		return 0;
+	if (f->type == t_to_array && f->desc && !element_target(ctx, f))
+		return 0;
+	f->i++;
+	return parse_value(ctx);
+}
+
+static size_t
+parse(struct mfromjson_ctx *ctx, char *in, size_t len,
+		enum json_value_type type, const void *desc, void *dst)
+{
+	ctx->error = e_parse_ok;
+	ctx->pos = 0;
+	ctx->in = in;
+	ctx->end = in + len;
+	ctx->p = in;
+	ctx->depth = 0;
+	ctx->type = type;
+	ctx->desc = desc;
+	ctx->dst = dst;
+	ctx->size = 0;
+	ctx->present = NULL;
+
+	skip_ws(ctx);
+	if (peek(ctx) != '{')
+		return fail(ctx, e_parse_syntax);
+	_Bool ok = parse_value(ctx);
+	while (ok && ctx->depth)
+		ok = parse_next(ctx);
+	return ok ? (size_t)(ctx->p - in) : 0;
+}
+
+size_t
+json_parse(struct mfromjson_ctx *ctx, char *in, size_t len,
+		const struct json_kv *kv)
+{
+	return parse(ctx, in, len, t_to_object, kv, NULL);
+}
+
+size_t
+json_parse_struct(struct mfromjson_ctx *ctx, char *in, size_t len,
+		const struct json_struct *js)
+{
+	return parse(ctx, in, len, t_to_struct, js->fields,
+			(void *)(uintptr_t)js->base);
+}
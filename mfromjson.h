@@ -0,0 +1,79 @@
+#ifndef RKTA_MFROMJSON_H
+#define RKTA_MFROMJSON_H
+
+#include "mtojson.h"
+
+/*
+ * Reads JSON into the same descriptors microtojson generates from: members of
+ * a json_kv table are written to where their value points. The input is
+ * changed in place, strings are unescaped where they are.
+ */
+
+enum json_parse_error {
+	e_parse_ok,
+	e_parse_syntax,
+	e_parse_type,
+	e_parse_range,
+	e_parse_space,
+	e_parse_depth,
+};
+
+// An object, struct or array being read, or a value that is only skipped
+struct json_parse_frame {
+	const void *desc;
+	char *base;
+	const char *start;
+	size_t i;
+	enum json_value_type type;
+};
+
+/*
+ * Caller owned state of a single json_parse() call, every call resets it.
+ * After an error, pos is the offset of the input where it was detected.
+ */
+struct mfromjson_ctx {
+	enum json_parse_error error;
+	size_t pos;
+
+	char *in;
+	char *end;
+	char *p;
+
+	// The value to be read next
+	enum json_value_type type;
+	void *dst;
+	const void *desc;
+	size_t size;
+	_Bool *present;
+
+	struct json_parse_frame stack[MAX_NESTING_DEPTH];
+	int depth;
+	char num[40];
+};
+
+/*
+ * Read the object at the start of the len bytes of in into kv and return the
+ * offset after it, or 0 on error. Whitespace before it is skipped, anything
+ * after it is left for the next call.
+ *
+ * Values of members are written to where kv points, as the type of the member
+ * says. Members not in kv are skipped, present is set to whether a member was
+ * there and not null. Keys are compared as they are, without unescaping.
+ *
+ * t_to_strn gets the string in the input and so do the elements of arrays of
+ * t_to_string, which are NUL terminated in place. t_to_valuen gets the JSON of
+ * any value as it is. Arrays are filled up to max elements and count is set
+ * to how many there were. Arrays of objects point to one table per element,
+ * arrays of t_to_struct to a single json_struct as when generating.
+ *
+ * Fields of type t_to_string of a struct are char arrays, JSON_FIELD() sets
+ * their size. A \u0000 in a string that is NUL terminated is an e_parse_range
+ * error, only t_to_strn can take it. t_to_string members in kv are not supported, nor are t_to_value,
+ * t_to_base64, t_to_hex and t_to_cached.
+ */
+size_t json_parse(struct mfromjson_ctx *ctx, char *in, size_t len,
+		const struct json_kv *kv);
+// Same for the fields of a struct at js->base
+size_t json_parse_struct(struct mfromjson_ctx *ctx, char *in, size_t len,
+		const struct json_struct *js);
+#endif
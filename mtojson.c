@@ -8,271 +8,2771 @@
 #include <limits.h>
 #include <string.h>
 
-static char* gen_array(char *out, struct json_array *jar);
-static char* gen_boolean(char *out, _Bool *val);
-static char* gen_integer(char *out, int *val);
-static char* gen_object(char *out, const struct json_kv *kv);
-static char* gen_string(char *out, char *val);
-static char* gen_uinteger(char *out, unsigned *val);
-static char* gen_value(char *out, char *val);
-
-char* (*gen_functions[])() = {
-	gen_array,
-	gen_boolean,
-	gen_integer,
-	gen_object,
-	gen_string,
-	gen_uinteger,
-	gen_value,
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+#ifndef MTOJSON_PARALLEL_MIN
+#define MTOJSON_PARALLEL_MIN 16384
+#endif
+
+#ifdef MTOJSON_THREADS
+static char* gen_parallel(struct mtojson_ctx *ctx, char *out, struct json_frame *f);
+#endif
+
+enum {
+	SINK_BUFFER,
+	SINK_STREAM,
+	SINK_COUNT,
+	SINK_RESUME,
+	SINK_IOV,
 };
 
-static size_t rem_len;
-static int nested_object_depth = 0;
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
 
-static void
-utoa(char *dst, unsigned n)
+static size_t
+count_digits(uint64_t n)
 {
-	char *s = dst;
+	size_t len = 1;
 
-	for (unsigned m = n; m > 10U;  m /= 10U)
-		s++;
-	s[1] = '\0';
+	for ( ; n > UINT32_MAX; n /= 100000000U)
+		len += 8;
 
-	for ( ; s >= dst; s--, n /= 10)
-		*s = (char)('0' + n % 10);
+	uint32_t m = (uint32_t)n;
+	for ( ; m >= 10000U; m /= 10000U)
+		len += 4;
+	return len + (m >= 10U) + (m >= 100U) + (m >= 1000U);
 }
 
+/*
+ * Write the digits of n backwards, the last one goes to end[-1]. Anything
+ * above 32 bit is split into chunks of 8 digits, so that 32 bit targets need
+ * just a few 64 bit divisions.
+ */
 static void
-itoa(char *dst, int n)
+utoa(char *end, uint64_t n)
+{
+	for ( ; n > UINT32_MAX; n /= 100000000U){
+		uint32_t m = (uint32_t)(n % 100000000U);
+		for (int i = 0; i < 4; i++, m /= 100U){
+			end -= 2;
+			memcpy(end, &digit_pairs[2 * (m % 100U)], 2);
+		}
+	}
+
+	uint32_t m = (uint32_t)n;
+	for ( ; m >= 100U; m /= 100U){
+		end -= 2;
+		memcpy(end, &digit_pairs[2 * (m % 100U)], 2);
+	}
+
+	if (m >= 10U){
+		end -= 2;
+		memcpy(end, &digit_pairs[2 * m], 2);
+	} else {
+		*--end = (char)('0' + m);
+	}
+}
+
+// Write the len characters of the number to dst
+static char*
+itoa(char *dst, size_t len, uint64_t n, _Bool neg)
+{
+	if (neg)
+		*dst = '-';
+	utoa(dst + len, n);
+	return dst + len;
+}
+
+static size_t
+format_unsigned(char *dst, uint64_t n)
+{
+	size_t len = count_digits(n);
+
+	utoa(dst + len, n);
+	return len;
+}
+
+static size_t
+format_signed(char *dst, int64_t n)
 {
-	unsigned u = (unsigned)n;
-	char *s = dst;
 	if (n < 0){
-		*s++ = '-';
-		u = -(unsigned)n;
+		*dst = '-';
+		return format_unsigned(dst + 1, -(uint64_t)n) + 1;
 	}
+	return format_unsigned(dst, (uint64_t)n);
+}
+
+#ifndef JSON_DOUBLE_DECIMALS
+/*
+ * Shortest representation of floating point numbers using Grisu2 by Florian
+ * Loitsch, following the implementation by Milo Yip. It uses integers only and
+ * always round trips, but in rare cases generates a digit more than needed.
+ */
+
+struct diy_fp {
+	uint64_t f;
+	int e;
+};
+
+// 10^-348, 10^-340, ..., 10^340 normalized to 64 bit
+static const uint64_t cached_powers_f[] = {
+	0xfa8fd5a0081c0288U, 0xbaaee17fa23ebf76U, 0x8b16fb203055ac76U,
+	0xcf42894a5dce35eaU, 0x9a6bb0aa55653b2dU, 0xe61acf033d1a45dfU,
+	0xab70fe17c79ac6caU, 0xff77b1fcbebcdc4fU, 0xbe5691ef416bd60cU,
+	0x8dd01fad907ffc3cU, 0xd3515c2831559a83U, 0x9d71ac8fada6c9b5U,
+	0xea9c227723ee8bcbU, 0xaecc49914078536dU, 0x823c12795db6ce57U,
+	0xc21094364dfb5637U, 0x9096ea6f3848984fU, 0xd77485cb25823ac7U,
+	0xa086cfcd97bf97f4U, 0xef340a98172aace5U, 0xb23867fb2a35b28eU,
+	0x84c8d4dfd2c63f3bU, 0xc5dd44271ad3cdbaU, 0x936b9fcebb25c996U,
+	0xdbac6c247d62a584U, 0xa3ab66580d5fdaf6U, 0xf3e2f893dec3f126U,
+	0xb5b5ada8aaff80b8U, 0x87625f056c7c4a8bU, 0xc9bcff6034c13053U,
+	0x964e858c91ba2655U, 0xdff9772470297ebdU, 0xa6dfbd9fb8e5b88fU,
+	0xf8a95fcf88747d94U, 0xb94470938fa89bcfU, 0x8a08f0f8bf0f156bU,
+	0xcdb02555653131b6U, 0x993fe2c6d07b7facU, 0xe45c10c42a2b3b06U,
+	0xaa242499697392d3U, 0xfd87b5f28300ca0eU, 0xbce5086492111aebU,
+	0x8cbccc096f5088ccU, 0xd1b71758e219652cU, 0x9c40000000000000U,
+	0xe8d4a51000000000U, 0xad78ebc5ac620000U, 0x813f3978f8940984U,
+	0xc097ce7bc90715b3U, 0x8f7e32ce7bea5c70U, 0xd5d238a4abe98068U,
+	0x9f4f2726179a2245U, 0xed63a231d4c4fb27U, 0xb0de65388cc8ada8U,
+	0x83c7088e1aab65dbU, 0xc45d1df942711d9aU, 0x924d692ca61be758U,
+	0xda01ee641a708deaU, 0xa26da3999aef774aU, 0xf209787bb47d6b85U,
+	0xb454e4a179dd1877U, 0x865b86925b9bc5c2U, 0xc83553c5c8965d3dU,
+	0x952ab45cfa97a0b3U, 0xde469fbd99a05fe3U, 0xa59bc234db398c25U,
+	0xf6c69a72a3989f5cU, 0xb7dcbf5354e9beceU, 0x88fcf317f22241e2U,
+	0xcc20ce9bd35c78a5U, 0x98165af37b2153dfU, 0xe2a0b5dc971f303aU,
+	0xa8d9d1535ce3b396U, 0xfb9b7cd9a4a7443cU, 0xbb764c4ca7a44410U,
+	0x8bab8eefb6409c1aU, 0xd01fef10a657842cU, 0x9b10a4e5e9913129U,
+	0xe7109bfba19c0c9dU, 0xac2820d9623bf429U, 0x80444b5e7aa7cf85U,
+	0xbf21e44003acdd2dU, 0x8e679c2f5e44ff8fU, 0xd433179d9c8cb841U,
+	0x9e19db92b4e31ba9U, 0xeb96bf6ebadf77d9U, 0xaf87023b9bf0ee6bU,
+};
+
+static const int16_t cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066,
+};
+#endif
 
-	utoa(s, u);
+static const uint64_t pow10_u64[] = {
+	1U, 10U, 100U,
+	1000U, 10000U, 100000U,
+	1000000U, 10000000U, 100000000U,
+	1000000000U, 10000000000U, 100000000000U,
+	1000000000000U, 10000000000000U, 100000000000000U,
+	1000000000000000U, 10000000000000000U, 100000000000000000U,
+	1000000000000000000U, 10000000000000000000U,
+};
+#if defined(JSON_DOUBLE_DECIMALS) && JSON_DOUBLE_DECIMALS > 18
+// The decimals are written as they are plus pow10_u64[JSON_DOUBLE_DECIMALS]
+#error "JSON_DOUBLE_DECIMALS must not be more than 18"
+#endif
+#ifndef JSON_DOUBLE_DECIMALS
+static struct diy_fp
+diy_normalize(struct diy_fp x)
+{
+	for ( ; !(x.f >> 54); x.e -= 10)
+		x.f <<= 10;
+	for ( ; !(x.f >> 63); x.e--)
+		x.f <<= 1;
+	return x;
 }
 
-static int
-reduce_rem_len(size_t len)
+// Upper 64 bit of x * y, rounded
+static uint64_t
+mul_hi(uint64_t x, uint64_t y)
 {
-	if (rem_len < len)
-		return 0;
-	rem_len -= len;
-	return 1;
+	uint64_t a = x >> 32, b = x & UINT32_MAX;
+	uint64_t c = y >> 32, d = y & UINT32_MAX;
+	uint64_t ad = a * d, bc = b * c;
+	uint64_t mid = ((b * d) >> 32) + (ad & UINT32_MAX) + (bc & UINT32_MAX);
+
+	mid += 1U << 31;
+	return a * c + (ad >> 32) + (bc >> 32) + (mid >> 32);
 }
 
-static char*
-strcpy_val(char *out, char *val, char *wrapper)
+// Cached power c with w.e + c.e in [-60, -32], *k is its negated exponent
+static struct diy_fp
+cached_power(int e, int *k)
 {
-	size_t wlen = wrapper ? 2 : 0;
-	size_t len = strlen(val);
+	// ceil((-61 - e) * log10(2)) + 347, log10(2) ~ 646456993 / 2^31
+	int64_t t = (int64_t)(-61 - e) * 646456993 + ((int64_t)347 << 31);
+	unsigned i = (unsigned)((t + INT64_C(0x7FFFFFFF)) >> 31 >> 3) + 1;
+	struct diy_fp c = { cached_powers_f[i], cached_powers_e[i] };
 
-	if (!reduce_rem_len(len + wlen))
-		return NULL;
-	if (wrapper)
-		*out++ = *wrapper;
-	memcpy(out, val, len);
-	out += len;
-	if (wrapper)
-		*out++ = *wrapper;
-	return out;
+	*k = 348 - (int)(i << 3);
+	return c;
 }
 
-static char*
-gen_boolean(char *out, _Bool *val)
+static void
+grisu_round(char *end, uint64_t delta, uint64_t rest, uint64_t ten_kappa,
+		uint64_t wp_w)
 {
-	char *t = "true";
-	char *f = "false";
-	char *v;
-	if (*val)
-		v = t;
+	while (rest < wp_w && delta - rest >= ten_kappa
+	       && (rest + ten_kappa < wp_w
+	           || wp_w - rest > rest + ten_kappa - wp_w)){
+		end[-1]--;
+		rest += ten_kappa;
+	}
+}
+
+/*
+ * Generate the digits of w = mp - wp_w within [mp - delta, mp], returns their
+ * count
+ */
+static NOINLINE size_t
+digit_gen(char *buf, struct diy_fp mp, uint64_t wp_w, uint64_t delta, int *k)
+{
+	int shift = -mp.e;
+	uint64_t one = (uint64_t)1 << shift;
+	uint32_t p1 = (uint32_t)(mp.f >> shift);
+	uint64_t p2 = mp.f & (one - 1);
+	int kappa = (int)count_digits(p1);
+	size_t len = 0;
+
+	while (kappa > 0){
+		uint32_t d = p1 / (uint32_t)pow10_u64[--kappa];
+		p1 %= (uint32_t)pow10_u64[kappa];
+		if (d || len)
+			buf[len++] = (char)('0' + d);
+
+		uint64_t rest = ((uint64_t)p1 << shift) + p2;
+		if (rest <= delta){
+			*k += kappa;
+			grisu_round(buf + len, delta, rest, pow10_u64[kappa] << shift,
+					wp_w);
+			return len;
+		}
+	}
+
+	for (;;){
+		p2 *= 10;
+		delta *= 10;
+		kappa--;
+		char d = (char)(p2 >> shift);
+		if (d || len)
+			buf[len++] = (char)('0' + d);
+
+		p2 &= one - 1;
+		if (p2 < delta){
+			*k += kappa;
+			grisu_round(buf + len, delta, p2, one,
+					wp_w * pow10_u64[-kappa]);
+			return len;
+		}
+	}
+}
+
+/*
+ * Write the shortest digits of f * 2^e to buf, so that buf * 10^k rounds to
+ * it. Returns the number of digits.
+ */
+static NOINLINE size_t
+grisu2(char *buf, uint64_t f, int e, _Bool lower_closer, int *k)
+{
+	// The upper boundary has the most bits, w and mm share its exponent
+	struct diy_fp mp = diy_normalize((struct diy_fp){ (f << 1) + 1, e - 1 });
+	uint64_t mm = ((f << 1) - 1) << (e - 1 - mp.e);
+
+	if (lower_closer)
+		mm = ((f << 2) - 1) << (e - 2 - mp.e);
+
+	struct diy_fp c = cached_power(mp.e, k);
+	uint64_t w = mul_hi(f << (e - mp.e), c.f);
+	mm = mul_hi(mm, c.f) + 1;
+	mp.f = mul_hi(mp.f, c.f) - 1;
+	mp.e += c.e + 64;
+	return digit_gen(buf, mp, mp.f - w, mp.f - mm, k);
+}
+
+static size_t
+exponent(char *dst, int e)
+{
+	size_t len = 1;
+
+	dst[0] = 'e';
+	if (e < 0){
+		dst[len++] = '-';
+		e = -e;
+	}
+	len += count_digits((unsigned)e);
+	utoa(dst + len, (unsigned)e);
+	return len;
+}
+
+/*
+ * Turn the len digits in buf times 10^k into a JSON number, like JavaScript
+ * does: 1234e-2 -> 12.34, 1234e-6 -> 0.001234, 1234e30 -> 1.234e33
+ */
+static NOINLINE size_t
+prettify(char *buf, size_t len, int k)
+{
+	int kk = (int)len + k; // 10^(kk - 1) <= v < 10^kk
+	size_t n = (size_t)kk;
+
+	if ((int)len <= kk && kk <= 21){
+		memset(buf + len, '0', n - len);
+		return n;
+	}
+	if (0 < kk && kk <= 21){
+		memmove(buf + n + 1, buf + n, len - n);
+		buf[n] = '.';
+		return len + 1;
+	}
+	if (-6 < kk && kk <= 0){
+		n = (size_t)(2 - kk);
+		memmove(buf + n, buf, len);
+		memset(buf, '0', n);
+		buf[1] = '.';
+		return len + n;
+	}
+	if (len == 1)
+		return 1 + exponent(buf + 1, kk - 1);
+
+	memmove(buf + 2, buf + 1, len - 1);
+	buf[1] = '.';
+	return len + 1 + exponent(buf + len + 1, kk - 1);
+}
+
+/*
+ * Format the IEEE 754 number with the biased exponent be and the fraction f
+ * of the given precision, not counting the hidden bit.
+ */
+static size_t
+ieee_to_str(char *dst, _Bool neg, int be, uint64_t f, int precision, int bias)
+{
+	char *s = dst;
+	int k;
+	size_t len;
+
+	if (neg)
+		*s++ = '-';
+	if (!be && !f){
+		*s = '0';
+		return (size_t)(s - dst) + 1;
+	}
+
+	if (be)
+		len = grisu2(s, f | (uint64_t)1 << precision, be - bias - precision,
+				!f && be > 1, &k);
 	else
-		v = f;
-	return strcpy_val(out, v, NULL);
+		len = grisu2(s, f, 1 - bias - precision, 0, &k);
+	return (size_t)(s - dst) + prettify(s, len, k);
 }
 
-static char*
-gen_string(char *out, char *val)
+static size_t
+dtoa(char *dst, double d)
 {
-	return strcpy_val(out, val, "\"");
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+
+	int be = (int)(u >> 52 & 0x7FF);
+	if (be == 0x7FF){
+		memcpy(dst, "null", 4);
+		return 4;
+	}
+	return ieee_to_str(dst, u >> 63, be, u & (((uint64_t)1 << 52) - 1), 52, 1023);
 }
 
-static char*
-gen_integer(char *out, int *val)
+static size_t
+ftoa(char *dst, float d)
 {
-	#define INT_STRING_SIZE ((sizeof(int)*CHAR_BIT - 1)*28/93 + 3)
-	char buf[INT_STRING_SIZE];
-	itoa(buf, *val);
-	return strcpy_val(out, buf, NULL);
-	#undef INT_STRING_SIZE
+	uint32_t u;
+	memcpy(&u, &d, sizeof(u));
+
+	int be = (int)(u >> 23 & 0xFF);
+	if (be == 0xFF){
+		memcpy(dst, "null", 4);
+		return 4;
+	}
+	return ieee_to_str(dst, u >> 31, be, u & (((uint32_t)1 << 23) - 1), 23, 127);
 }
+#else
+/*
+ * Format d with JSON_DOUBLE_DECIMALS decimals. This needs a single floating
+ * point multiplication, numbers with more than about 19 digits are null.
+ */
+static size_t
+dtoa(char *dst, double d)
+{
+	const uint64_t scale = pow10_u64[JSON_DOUBLE_DECIMALS];
+	double a = (d < 0 ? -d : d) * (double)scale + 0.5;
+	char *s = dst;
 
-static char*
-gen_uinteger(char *out, unsigned *val)
+	if (!(a < 18446744073709551616.0)){ // Catches NaN, too
+		memcpy(dst, "null", 4);
+		return 4;
+	}
+
+	uint64_t n = (uint64_t)a;
+	if (d < 0 && n)
+		*s++ = '-';
+	s += count_digits(n / scale);
+	utoa(s, n / scale);
+	if (JSON_DOUBLE_DECIMALS){
+		// Adding scale keeps leading zeros, its 1 is replaced by the point
+		s += JSON_DOUBLE_DECIMALS + 1;
+		utoa(s, n % scale + scale);
+		s[-JSON_DOUBLE_DECIMALS - 1] = '.';
+	}
+	return (size_t)(s - dst);
+}
+
+static size_t
+ftoa(char *dst, float d)
 {
-	#define INT_STRING_SIZE ((sizeof(int)*CHAR_BIT - 1)*28/93 + 3)
-	char buf[INT_STRING_SIZE];
-	utoa(buf, *val);
-	return strcpy_val(out, buf, NULL);
-	#undef INT_STRING_SIZE
+	return dtoa(dst, d);
 }
+#endif
 
 static char*
-gen_value(char *out, char *val)
+flush_buf(struct mtojson_ctx *ctx, char *out)
 {
-	return strcpy_val(out, val, NULL);
+	size_t len = (size_t)(out - ctx->buf);
+
+	if (len && ctx->flush(ctx, ctx->buf, len)){
+		ctx->error = e_json_flush;
+		return NULL;
+	}
+	ctx->total += len;
+	ctx->rem_len = ctx->buf_len;
+	return ctx->buf;
 }
 
 static char*
-gen_array_type(char *out, const void *val, _Bool is_last, char* (*func)())
+flush_rem_len(struct mtojson_ctx *ctx, char *out, size_t len)
 {
-	out = (*func)(out, val);
-	if (!out)
+	if (ctx->sink == SINK_COUNT){
+		ctx->total += len;
+		return ctx->tmp;
+	}
+
+	if (ctx->sink == SINK_RESUME && len <= sizeof(ctx->tmp)){
+		ctx->pend = ctx->tmp;
+		ctx->pend_len = len;
+		return ctx->tmp;
+	}
+
+	if (ctx->sink != SINK_STREAM || ctx->buf_len < len){
+		ctx->error = e_json_no_space;
 		return NULL;
-	if (!is_last){
-		if (!reduce_rem_len(2))
-			return NULL;
-		*out++ = ',';
-		*out++ = ' ';
 	}
+	out = flush_buf(ctx, out);
+	if (out)
+		ctx->rem_len -= len;
+	return out;
+}
+
+/*
+ * Returns where to write the next len bytes to, flushing a full stream buffer.
+ * When counting, all writes are going to ctx->tmp.
+ */
+static char*
+reduce_rem_len(struct mtojson_ctx *ctx, char *out, size_t len)
+{
+	if (ctx->rem_len < len)
+		return flush_rem_len(ctx, out, len);
+	ctx->rem_len -= len;
 	return out;
 }
 
+/*
+ * Write what fits and keep the rest for the next json_gen_next() call.
+ * Anything larger than ctx->tmp must point into kv, which outlives the call.
+ */
 static char*
-gen_array(char *out, struct json_array *jar)
+stash(struct mtojson_ctx *ctx, char *out, const char *val, size_t len)
+{
+	size_t n = ctx->rem_len;
+
+	memcpy(out, val, n);
+	val += n;
+	len -= n;
+	ctx->rem_len = 0;
+	if (len <= sizeof(ctx->tmp)){
+		memmove(ctx->tmp, val, len);
+		val = ctx->tmp;
+	}
+	ctx->pend = val;
+	ctx->pend_len = len;
+	return out + n;
+}
+
+static _Bool
+add_iov(struct mtojson_ctx *ctx, const char *base, size_t len)
+{
+	if (ctx->iov_cnt == ctx->iov_max){
+		ctx->error = e_json_no_space;
+		return 0;
+	}
+	ctx->iov[ctx->iov_cnt].iov_base = (void *)(uintptr_t)base;
+	ctx->iov[ctx->iov_cnt++].iov_len = len;
+	ctx->total += len;
+	return 1;
+}
+
+// End the current scratch segment and reference val where it is
+static NOINLINE char*
+add_ref(struct mtojson_ctx *ctx, char *out, const char *val, size_t len)
 {
-	if (!reduce_rem_len(2)) // 2 -> []
+	if (out != ctx->seg && !add_iov(ctx, ctx->seg, (size_t)(out - ctx->seg)))
+		return NULL;
+	if (!add_iov(ctx, val, len))
 		return NULL;
+	ctx->seg = out;
+	return out;
+}
 
-	*out++ = '[';
-	if (jar->count == 0){
-		*out++ = ']';
+static char*
+copy_out(struct mtojson_ctx *ctx, char *out, const char *val, size_t len)
+{
+	if (ctx->sink == SINK_COUNT){
+		ctx->total += len;
 		return out;
 	}
 
-	_Bool is_last;
-	char* (*func)() = gen_functions[jar->type];
-	if (jar->type == t_to_array){
-		struct json_array * const *val = jar->value;
-		for (size_t i = 0; i < jar->count; i++){
-			is_last = (i + 1 == jar->count);
-			out = gen_array_type(out, val[i], is_last, func);
-			if (!out)
-				return NULL;
-		}
+	if (ctx->sink == SINK_RESUME && ctx->rem_len < len)
+		return stash(ctx, out, val, len);
+
+	// Only ctx->tmp gets overwritten, anything else stays valid
+	if (ctx->sink == SINK_IOV && len >= ctx->threshold && val != ctx->tmp)
+		return add_ref(ctx, out, val, len);
+
+	while (ctx->sink == SINK_STREAM && ctx->rem_len < len){
+		size_t n = ctx->rem_len;
+		memcpy(out, val, n);
+		val += n;
+		len -= n;
+		ctx->rem_len = 0;
+		out = flush_buf(ctx, out + n);
+		if (!out)
+			return NULL;
 	}
 
-	else if (jar->type == t_to_boolean){
-		const _Bool *val = jar->value;
-		for (size_t i = 0; i < jar->count; i++){
-			is_last = (i + 1 == jar->count);
-			out = gen_array_type(out, &val[i], is_last, func);
-			if (!out)
-				return NULL;
-		}
+	out = reduce_rem_len(ctx, out, len);
+	if (!out)
+		return NULL;
+	memcpy(out, val, len);
+	return out + len;
+}
+
+// JSON escape of the control characters
+static const char ctrl_escapes[32][7] = {
+	"\\u0000", "\\u0001", "\\u0002", "\\u0003",
+	"\\u0004", "\\u0005", "\\u0006", "\\u0007",
+	"\\b", "\\t", "\\n", "\\u000b",
+	"\\f", "\\r", "\\u000e", "\\u000f",
+	"\\u0010", "\\u0011", "\\u0012", "\\u0013",
+	"\\u0014", "\\u0015", "\\u0016", "\\u0017",
+	"\\u0018", "\\u0019", "\\u001a", "\\u001b",
+	"\\u001c", "\\u001d", "\\u001e", "\\u001f",
+};
+
+static _Bool
+needs_escape(char c)
+{
+	return (unsigned char)c < 0x20 || c == '"' || c == '\\';
+}
+
+// Return whether the 16 bytes at p need no escaping
+static _Bool
+clean16(const char *p)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *)(const void *)p);
+	__m128i ctrl = _mm_set1_epi8(0x1F);
+	__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+
+	// Unsigned v <= 0x1F
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+	return !_mm_movemask_epi8(m);
+#elif defined(__ARM_NEON)
+	uint8x16_t v = vld1q_u8((const uint8_t *)p);
+	uint8x16_t m = vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+			vceqq_u8(v, vdupq_n_u8('\\')));
+	uint64x2_t w;
+
+	m = vorrq_u8(m, vcltq_u8(v, vdupq_n_u8(0x20)));
+	w = vreinterpretq_u64_u8(m);
+	return !(vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1));
+#else
+	// Eight bytes at a time, the high bit is set in every byte that matches
+	const uint64_t ones = 0x0101010101010101U;
+	uint64_t t = 0;
+
+	for (int i = 0; i < 16; i += 8){
+		uint64_t x, q, b;
+		memcpy(&x, p + i, sizeof(x));
+		q = x ^ (ones * '"');
+		b = x ^ (ones * '\\');
+		t |= ((x - ones * 0x20) & ~x) | ((q - ones) & ~q)
+			| ((b - ones) & ~b);
 	}
+	return !(t & ones << 7);
+#endif
+}
 
-	else if (jar->type == t_to_integer){
-		const int *val = jar->value;
-		for (size_t i = 0; i < jar->count; i++){
-			is_last = (i + 1 == jar->count);
-			out = gen_array_type(out, &val[i], is_last, func);
-			if (!out)
-				return NULL;
-		}
+// Length of the leading part of p that needs no escaping
+static size_t
+clean_run(const char *p, size_t len)
+{
+	size_t i = 0;
+
+	while (i + 16 <= len && clean16(p + i))
+		i += 16;
+	while (i < len && !needs_escape(p[i]))
+		i++;
+	return i;
+}
+
+static const char base64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char hex_chars[] = "0123456789abcdef";
+
+#if defined(__SSSE3__)
+/*
+ * Base64 of the first 12 of 16 bytes at src, following Wojciech Muła: shuffle
+ * the 3 byte groups into 32 bit lanes, move the 6 bit indices into bytes with
+ * two multiplications and turn them into characters by adding the offset of
+ * their range.
+ */
+static void
+base64_12(char *dst, const uint8_t *src)
+{
+	__m128i in = _mm_loadu_si128((const __m128i *)(const void *)src);
+	__m128i t0, t1, idx, r;
+
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+			4, 5, 3, 4, 1, 2, 0, 1));
+	t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+			_mm_set1_epi32(0x04000040));
+	t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+			_mm_set1_epi32(0x01000010));
+	idx = _mm_or_si128(t0, t1);
+
+	r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+			_mm_set1_epi8(13)));
+	r = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), r);
+	_mm_storeu_si128((__m128i *)(void *)dst, _mm_add_epi8(r, idx));
+}
+#elif defined(__aarch64__)
+// Base64 of 48 bytes at src, the table lookup takes 64 entries at once
+static void
+base64_48(char *dst, const uint8_t *src)
+{
+	const uint8_t *c = (const uint8_t *)base64_chars;
+	uint8x16x4_t tbl = {{ vld1q_u8(c), vld1q_u8(c + 16), vld1q_u8(c + 32),
+		vld1q_u8(c + 48) }};
+	uint8x16x3_t in = vld3q_u8(src);
+	uint8x16_t m = vdupq_n_u8(0x3F);
+	uint8x16x4_t r;
+
+	r.val[0] = vshrq_n_u8(in.val[0], 2);
+	r.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4),
+			vshrq_n_u8(in.val[1], 4)), m);
+	r.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2),
+			vshrq_n_u8(in.val[2], 6)), m);
+	r.val[3] = vandq_u8(in.val[2], m);
+	for (int i = 0; i < 4; i++)
+		r.val[i] = vqtbl4q_u8(tbl, r.val[i]);
+	vst4q_u8((uint8_t *)dst, r);
+}
+#endif
+
+// Write the base64 of n bytes, padded if n isn't a multiple of 3
+static size_t
+base64_encode(char *dst, const uint8_t *src, size_t n)
+{
+	char *d = dst;
+	size_t i = 0;
+
+#if defined(__SSSE3__)
+	for ( ; n - i >= 16; i += 12, d += 16)
+		base64_12(d, src + i);
+#elif defined(__aarch64__)
+	for ( ; n - i >= 48; i += 48, d += 64)
+		base64_48(d, src + i);
+#endif
+	for ( ; n - i >= 3; i += 3, d += 4){
+		uint32_t v = (uint32_t)src[i] << 16 | (uint32_t)src[i + 1] << 8
+			| src[i + 2];
+		d[0] = base64_chars[v >> 18];
+		d[1] = base64_chars[v >> 12 & 0x3F];
+		d[2] = base64_chars[v >> 6 & 0x3F];
+		d[3] = base64_chars[v & 0x3F];
 	}
+	if (n - i){
+		uint32_t v = (uint32_t)src[i] << 16;
+		if (n - i == 2)
+			v |= (uint32_t)src[i + 1] << 8;
+		d[0] = base64_chars[v >> 18];
+		d[1] = base64_chars[v >> 12 & 0x3F];
+		d[2] = n - i == 2 ? base64_chars[v >> 6 & 0x3F] : '=';
+		d[3] = '=';
+		d += 4;
+	}
+	return (size_t)(d - dst);
+}
 
-	else if (jar->type == t_to_object){
-		struct json_kv * const *val = jar->value;
-		for (size_t i = 0; i < jar->count; i++){
-			is_last = (i + 1 == jar->count);
-			out = gen_array_type(out, val[i], is_last, func);
-			if (!out)
-				return NULL;
-		}
+// Write the lower case hex of n bytes
+static size_t
+hex_encode(char *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	// Nibbles above 9 get 'a' - '0' - 10 added
+	for ( ; n - i >= 16; i += 16){
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)(src + i));
+		__m128i m = _mm_set1_epi8(0x0F);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+		__m128i lo = _mm_and_si128(v, m);
+		__m128i nine = _mm_set1_epi8(9);
+		__m128i zero = _mm_set1_epi8('0');
+		__m128i gap = _mm_set1_epi8('a' - '0' - 10);
+
+		hi = _mm_add_epi8(_mm_add_epi8(hi, zero),
+				_mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, zero),
+				_mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+		_mm_storeu_si128((__m128i *)(void *)(dst + 2 * i),
+				_mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(void *)(dst + 2 * i + 16),
+				_mm_unpackhi_epi8(hi, lo));
 	}
+#elif defined(__ARM_NEON)
+	for ( ; n - i >= 16; i += 16){
+		uint8x16_t v = vld1q_u8(src + i);
+		uint8x16_t nine = vdupq_n_u8(9);
+		uint8x16_t zero = vdupq_n_u8('0');
+		uint8x16_t gap = vdupq_n_u8('a' - '0' - 10);
+		uint8x16x2_t r;
 
-	else if (jar->type == t_to_string){
-		char * const *val = jar->value;
-		for (size_t i = 0; i < jar->count; i++){
-			is_last = (i + 1 == jar->count);
-			out = gen_array_type(out, val[i], is_last, func);
-			if (!out)
-				return NULL;
-		}
+		r.val[0] = vshrq_n_u8(v, 4);
+		r.val[1] = vandq_u8(v, vdupq_n_u8(0x0F));
+		for (int j = 0; j < 2; j++)
+			r.val[j] = vaddq_u8(vaddq_u8(r.val[j], zero),
+					vandq_u8(vcgtq_u8(r.val[j], nine), gap));
+		vst2q_u8((uint8_t *)dst + 2 * i, r);
+	}
+#endif
+	for ( ; i < n; i++){
+		dst[2 * i] = hex_chars[src[i] >> 4];
+		dst[2 * i + 1] = hex_chars[src[i] & 0x0F];
 	}
+	return 2 * n;
+}
 
-	*out++ = ']';
+static char*
+put_char(struct mtojson_ctx *ctx, char *out, char c)
+{
+	out = reduce_rem_len(ctx, out, 1);
+	if (!out)
+		return NULL;
+	*out++ = c;
 	return out;
 }
 
 static char*
-gen_object(char *out, const struct json_kv *kv)
+strcpy_val(struct mtojson_ctx *ctx, char *out, const char *val)
 {
-#ifdef MAX_NESTED_OBJECT_DEPTH
-	if (nested_object_depth > MAX_NESTED_OBJECT_DEPTH)
-		goto fail;
-#endif
-	size_t object_meta_len = 2; // 2 -> {}
-	if (nested_object_depth == 0)
-		object_meta_len = 3; // 3 -> {}\0
-	nested_object_depth++;
-
-	if (!reduce_rem_len(object_meta_len))
-		goto fail;
+	return copy_out(ctx, out, val, strlen(val));
+}
 
-	*out++ = '{';
-	while (kv->key){
-		char *key = kv->key;
-		size_t len = strlen(key);
-		if (!reduce_rem_len(len + 4)) // 4 -> "":_
-			goto fail;
+static char*
+gen_boolean(struct mtojson_ctx *ctx, char *out, const _Bool *val)
+{
+	char *t = "true";
+	char *f = "false";
+	char *v;
+	if (*val)
+		v = t;
+	else
+		v = f;
+	return strcpy_val(ctx, out, v);
+}
 
-		*out++ = '"';
-		memcpy(out, key, len);
-		out += len;
-		*out++ = '"';
-		*out++ = ':';
-		*out++ = ' ';
+/*
+ * Write the number straight to out if it fits. Otherwise it is formatted into
+ * ctx->tmp and passed on from there.
+ */
+static char*
+put_digits(struct mtojson_ctx *ctx, char *out, uint64_t n, _Bool neg)
+{
+	size_t len = count_digits(n) + neg;
 
-		out = gen_functions[kv->type](out, kv->value);
+	if (ctx->rem_len >= len){
+		ctx->rem_len -= len;
+		return itoa(out, len, n, neg);
+	}
 
-		if (!out)
-			goto fail;
+	if (ctx->sink != SINK_COUNT)
+		itoa(ctx->tmp, len, n, neg);
+	return copy_out(ctx, out, ctx->tmp, len);
+}
 
-		if ((kv + 1)->key){
-			if (!reduce_rem_len(2))
-				goto fail;
-			*out++ = ',';
-			*out++ = ' ';
-		}
+static char*
+put_signed(struct mtojson_ctx *ctx, char *out, int64_t n)
+{
+	if (n < 0)
+		return put_digits(ctx, out, -(uint64_t)n, 1);
+	return put_digits(ctx, out, (uint64_t)n, 0);
+}
 
-		kv++;
-	}
+static char*
+gen_integer(struct mtojson_ctx *ctx, char *out, const int *val)
+{
+	return put_signed(ctx, out, *val);
+}
 
-	*out++ = '}';
-	*out = '\0';
-	nested_object_depth--;
-	return out;
+static char*
+gen_uinteger(struct mtojson_ctx *ctx, char *out, const unsigned *val)
+{
+	return put_digits(ctx, out, *val, 0);
+}
 
-fail:
-	nested_object_depth = 0;
-	return NULL;
+static char*
+gen_int8(struct mtojson_ctx *ctx, char *out, const int8_t *val)
+{
+	return put_signed(ctx, out, *val);
 }
 
-size_t
-generate_json(char *out, const struct json_kv *kv, size_t len)
+static char*
+gen_int16(struct mtojson_ctx *ctx, char *out, const int16_t *val)
 {
-	const char *start = out;
+	return put_signed(ctx, out, *val);
+}
 
-	rem_len = len;
-	out = gen_object(out, kv);
+static char*
+gen_int32(struct mtojson_ctx *ctx, char *out, const int32_t *val)
+{
+	return put_signed(ctx, out, *val);
+}
 
+static char*
+gen_int64(struct mtojson_ctx *ctx, char *out, const int64_t *val)
+{
+	return put_signed(ctx, out, *val);
+}
+
+static char*
+gen_uint8(struct mtojson_ctx *ctx, char *out, const uint8_t *val)
+{
+	return put_digits(ctx, out, *val, 0);
+}
+
+static char*
+gen_uint16(struct mtojson_ctx *ctx, char *out, const uint16_t *val)
+{
+	return put_digits(ctx, out, *val, 0);
+}
+
+static char*
+gen_uint32(struct mtojson_ctx *ctx, char *out, const uint32_t *val)
+{
+	return put_digits(ctx, out, *val, 0);
+}
+
+static char*
+gen_uint64(struct mtojson_ctx *ctx, char *out, const uint64_t *val)
+{
+	return put_digits(ctx, out, *val, 0);
+}
+
+// Longest number dtoa() generates: -0.0000012345678901234567
+#define DOUBLE_STRING_SIZE 25
+
+static char*
+gen_float(struct mtojson_ctx *ctx, char *out, const float *val)
+{
+	char *dst = ctx->rem_len >= DOUBLE_STRING_SIZE ? out : ctx->tmp;
+	size_t len = ftoa(dst, *val);
+
+	if (dst == ctx->tmp)
+		return copy_out(ctx, out, dst, len);
+	ctx->rem_len -= len;
+	return out + len;
+}
+
+static char*
+gen_double(struct mtojson_ctx *ctx, char *out, const double *val)
+{
+	char *dst = ctx->rem_len >= DOUBLE_STRING_SIZE ? out : ctx->tmp;
+	size_t len = dtoa(dst, *val);
+
+	if (dst == ctx->tmp)
+		return copy_out(ctx, out, dst, len);
+	ctx->rem_len -= len;
+	return out + len;
+}
+
+static char*
+gen_value(struct mtojson_ctx *ctx, char *out, const char *val)
+{
+	return strcpy_val(ctx, out, val);
+}
+
+static char*
+gen_valuen(struct mtojson_ctx *ctx, char *out, const struct json_str *val)
+{
+	return copy_out(ctx, out, val->p, val->len);
+}
+
+// Everything but objects, arrays, strings and binary data, in one step
+static char*
+gen_scalar(struct mtojson_ctx *ctx, char *out)
+{
+	const void *val = ctx->val;
+
+	switch (ctx->type){
+	case t_to_boolean:
+		return gen_boolean(ctx, out, val);
+	case t_to_integer:
+		return gen_integer(ctx, out, val);
+	case t_to_uinteger:
+		return gen_uinteger(ctx, out, val);
+	case t_to_value:
+		return gen_value(ctx, out, val);
+	case t_to_int8:
+		return gen_int8(ctx, out, val);
+	case t_to_int16:
+		return gen_int16(ctx, out, val);
+	case t_to_int32:
+		return gen_int32(ctx, out, val);
+	case t_to_int64:
+		return gen_int64(ctx, out, val);
+	case t_to_uint8:
+		return gen_uint8(ctx, out, val);
+	case t_to_uint16:
+		return gen_uint16(ctx, out, val);
+	case t_to_uint32:
+		return gen_uint32(ctx, out, val);
+	case t_to_uint64:
+		return gen_uint64(ctx, out, val);
+	case t_to_float:
+		return gen_float(ctx, out, val);
+	case t_to_double:
+		return gen_double(ctx, out, val);
+	case t_to_valuen:
+		return gen_valuen(ctx, out, val);
+	case t_to_null:
+		return copy_out(ctx, out, "null", 4);
+	default:
+		return out;
+	}
+}
+
+enum {
+	ST_VALUE,
+	ST_STRING,
+	ST_BINARY,
+	ST_MEMBER,
+	ST_KEY,
+	ST_COLON,
+	ST_ELEMENT,
+	ST_NEXT,
+	ST_DONE,
+};
+
+#ifdef MTOJSON_STATS
+// Bytes of JSON generated so far, including what waits for json_gen_next()
+static size_t
+stat_pos(struct mtojson_ctx *ctx, char *out)
+{
+	if (ctx->sink == SINK_COUNT)
+		return ctx->total;
+	if (ctx->sink == SINK_IOV)
+		return ctx->total + (size_t)(out - ctx->seg);
+	// Pieces that don't fit go to ctx->tmp and are pending
+	if (ctx->sink == SINK_RESUME)
+		return ctx->total + ctx->buf_len - ctx->rem_len + ctx->pend_len;
+	return ctx->total + (size_t)(out - ctx->buf);
+}
+
+/*
+ * stat_step() counts all bytes of a step for the type it starts with. Count
+ * len of them for values of type instead, written by the fast paths.
+ */
+static void
+stat_move(struct mtojson_ctx *ctx, enum json_value_type from,
+		enum json_value_type type, size_t len, size_t fields)
+{
+	ctx->stats.bytes[from] -= len;
+	ctx->stats.bytes[type] += len;
+	ctx->stats.fields += fields;
+}
+#endif
+
+static const void*
+array_elem(const struct json_array *jar, size_t i)
+{
+	switch (jar->type){
+	case t_to_boolean:
+		return (const _Bool *)jar->value + i;
+	case t_to_integer:
+		return (const int *)jar->value + i;
+	case t_to_uinteger:
+		return (const unsigned *)jar->value + i;
+	case t_to_int8:
+		return (const int8_t *)jar->value + i;
+	case t_to_int16:
+		return (const int16_t *)jar->value + i;
+	case t_to_int32:
+		return (const int32_t *)jar->value + i;
+	case t_to_int64:
+		return (const int64_t *)jar->value + i;
+	case t_to_uint8:
+		return (const uint8_t *)jar->value + i;
+	case t_to_uint16:
+		return (const uint16_t *)jar->value + i;
+	case t_to_uint32:
+		return (const uint32_t *)jar->value + i;
+	case t_to_uint64:
+		return (const uint64_t *)jar->value + i;
+	case t_to_float:
+		return (const float *)jar->value + i;
+	case t_to_double:
+		return (const double *)jar->value + i;
+	case t_to_strn:
+	case t_to_valuen:
+		return (const struct json_str *)jar->value + i;
+	case t_to_base64:
+	case t_to_hex:
+		return (const struct json_bin *)jar->value + i;
+	case t_to_null:
+		return NULL;
+	default:
+		return ((const void * const *)jar->value)[i];
+	}
+}
+
+static char*
+push_frame(struct mtojson_ctx *ctx, char *out)
+{
+	if (ctx->depth == MAX_NESTING_DEPTH){
+		ctx->error = e_json_max_depth;
+		return NULL;
+	}
+	if (ctx->type != t_to_array){
+#ifdef MAX_NESTED_OBJECT_DEPTH
+		if (ctx->nested_object_depth > MAX_NESTED_OBJECT_DEPTH){
+			ctx->error = e_json_max_depth;
+			return NULL;
+		}
+#endif
+		ctx->nested_object_depth++;
+	}
+
+	struct json_frame *f = &ctx->stack[ctx->depth++];
+	f->node = ctx->val;
+	f->i = 0;
+	f->type = ctx->type;
+	f->cache = NULL;
+	if (f->type == t_to_struct){
+		const struct json_struct *js = ctx->val;
+		f->node = js->fields;
+		f->base = js->base;
+	}
+#ifdef MTOJSON_STATS
+	if (ctx->depth > ctx->stats.peak_depth)
+		ctx->stats.peak_depth = ctx->depth;
+	if (ctx->hook)
+		ctx->hook(ctx, f->type, ctx->depth, 0);
+#endif
+	if (f->type != t_to_array){
+		ctx->state = ST_MEMBER;
+		return put_char(ctx, out, '{');
+	}
+	ctx->state = ST_ELEMENT;
+	return put_char(ctx, out, '[');
+}
+
+// Keep the JSON of a cached value from start to end, if it fits
+static NOINLINE void
+fill_cache(struct mtojson_ctx *ctx, struct json_cache *c, const char *start,
+		const char *end)
+{
+	size_t len = (size_t)(end - start);
+
+	c->len = 0;
+	if (len > c->size)
+		return;
+	memcpy(c->buf, start, len);
+	c->len = len;
+	c->seen = *c->gen;
+	c->compact = ctx->compact;
+}
+
+static char*
+pop_frame(struct mtojson_ctx *ctx, char *out)
+{
+	struct json_frame *f = &ctx->stack[ctx->depth - 1];
+
+	ctx->state = ST_NEXT;
+#ifdef MTOJSON_STATS
+	if (ctx->hook)
+		ctx->hook(ctx, f->type, ctx->depth, 1);
+#endif
+	ctx->depth--;
+	if (f->type != t_to_array){
+		ctx->nested_object_depth--;
+		out = put_char(ctx, out, '}');
+	} else {
+		out = put_char(ctx, out, ']');
+	}
+	if (out && f->cache)
+		fill_cache(ctx, f->cache, f->start, out);
+	return out;
+}
+
+// Longest JSON of a value of type, 0 if it varies
+static size_t
+fixed_width(enum json_value_type type)
+{
+	switch (type){
+	case t_to_boolean:
+		return 5;
+	case t_to_integer:
+		return count_digits(-(uint64_t)INT_MIN) + 1;
+	case t_to_uinteger:
+		return count_digits(UINT_MAX);
+	case t_to_int8:
+		return 4;
+	case t_to_int16:
+		return 6;
+	case t_to_int32:
+		return 11;
+	case t_to_int64:
+	case t_to_uint64:
+		return 20;
+	case t_to_uint8:
+		return 3;
+	case t_to_uint16:
+		return 5;
+	case t_to_uint32:
+		return 10;
+	case t_to_float:
+	case t_to_double:
+		return DOUBLE_STRING_SIZE;
+	case t_to_null:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Write a value of a type with fixed_width() straight to dst and return its
+ * length, or 0 for other types
+ */
+static NOINLINE size_t
+format_fixed(char *dst, enum json_value_type type, const void *value)
+{
+	switch (type){
+	case t_to_boolean:
+		if (*(const _Bool *)value){
+			memcpy(dst, "true", 4);
+			return 4;
+		}
+		memcpy(dst, "false", 5);
+		return 5;
+	case t_to_integer:
+		return format_signed(dst, *(const int *)value);
+	case t_to_uinteger:
+		return format_unsigned(dst, *(const unsigned *)value);
+	case t_to_int8:
+		return format_signed(dst, *(const int8_t *)value);
+	case t_to_int16:
+		return format_signed(dst, *(const int16_t *)value);
+	case t_to_int32:
+		return format_signed(dst, *(const int32_t *)value);
+	case t_to_int64:
+		return format_signed(dst, *(const int64_t *)value);
+	case t_to_uint8:
+		return format_unsigned(dst, *(const uint8_t *)value);
+	case t_to_uint16:
+		return format_unsigned(dst, *(const uint16_t *)value);
+	case t_to_uint32:
+		return format_unsigned(dst, *(const uint32_t *)value);
+	case t_to_uint64:
+		return format_unsigned(dst, *(const uint64_t *)value);
+	case t_to_float:
+		return ftoa(dst, *(const float *)value);
+	case t_to_double:
+		return dtoa(dst, *(const double *)value);
+	case t_to_null:
+		memcpy(dst, "null", 4);
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Start a new line before the next member or element of f, or before its
+ * closing bracket. gen_step() indents it in the following steps.
+ */
+static char*
+put_newline(struct mtojson_ctx *ctx, char *out, struct json_frame *f, _Bool end)
+{
+	ctx->nl = 1;
+	ctx->pad = (size_t)(ctx->depth - end) * ctx->indent;
+	if (f->i && !end)
+		return copy_out(ctx, out, ",\n", 2);
+	return put_char(ctx, out, '\n');
+}
+
+static char*
+put_pad(struct mtojson_ctx *ctx, char *out)
+{
+	static const char spaces[] = "                                ";
+	size_t n = ctx->pad < sizeof(spaces) - 1 ? ctx->pad : sizeof(spaces) - 1;
+
+	ctx->pad -= n;
+	return copy_out(ctx, out, spaces, n);
+}
+
+static char*
+put_sep(char *out, size_t sep)
+{
+	if (sep)
+		*out++ = ',';
+	if (sep == 2)
+		*out++ = ' ';
+	return out;
+}
+
+// Write the separator, the quoted key and the colon of a member
+static NOINLINE char*
+put_key(char *out, size_t sep, const char *key, size_t key_len, _Bool compact)
+{
+	out = put_sep(out, sep);
+	*out++ = '"';
+	memcpy(out, key, key_len);
+	out += key_len;
+	memcpy(out, "\": ", 3U - compact);
+	return out + 3 - compact;
+}
+
+static NOINLINE char*
+put_fixed(struct mtojson_ctx *ctx, char *out, const struct json_kv *kv)
+{
+	size_t len = format_fixed(out, kv->type, kv->value);
+
+	ctx->rem_len -= len;
+	ctx->state = ST_NEXT;
+#ifdef MTOJSON_STATS
+	stat_move(ctx, ctx->stack[ctx->depth - 1].type, kv->type, len, 1);
+#endif
+	return out + len;
+}
+
+/*
+ * Write the whole member kv with a value of fixed width at once, if there is
+ * space for the longest possible one. Returns NULL if not.
+ */
+static NOINLINE char*
+put_member(struct mtojson_ctx *ctx, char *out, struct json_frame *f,
+		const struct json_kv *kv)
+{
+	size_t sep = f->i ? 2U - ctx->compact : 0;
+	size_t key_len = kv->key_len ? kv->key_len : strlen(kv->key);
+	size_t head = sep + key_len + 4U - ctx->compact;
+	size_t width = fixed_width(kv->type);
+
+	if (!width || ctx->rem_len < head + width)
+		return NULL;
+
+	ctx->rem_len -= head;
+	out = put_key(out, sep, kv->key, key_len, ctx->compact);
+	return put_fixed(ctx, out, kv);
+}
+
+/*
+ * The current field of a struct as member in ctx->member, its value is where
+ * the field is. A nested struct is passed on in ctx->elem.
+ */
+static const struct json_kv*
+struct_member(struct mtojson_ctx *ctx, const struct json_frame *f)
+{
+	const struct json_field *field = f->node;
+	struct json_kv *kv = &ctx->member;
+
+	kv->key = field->key;
+	kv->key_len = field->key_len;
+	kv->type = field->type;
+	kv->value = f->base + field->offset;
+	kv->present = NULL;
+	if (field->type == t_to_struct){
+		ctx->elem.fields = field->fields;
+		ctx->elem.base = kv->value;
+		kv->value = &ctx->elem;
+	}
+	return kv;
+}
+
+static char*
+gen_member(struct mtojson_ctx *ctx, char *out, struct json_frame *f)
+{
+	const struct json_kv *kv = f->node;
+	char *p;
+
+	if (f->type == t_to_struct){
+		kv = struct_member(ctx, f);
+	} else {
+		while (kv->key && kv->present && !*kv->present)
+			kv++;
+		f->node = kv;
+	}
+
+	// Templates need the values as slots, scatter-gather may reference keys
+	if (kv->key && !ctx->indent && !ctx->tpl && ctx->sink != SINK_IOV
+	    && (p = put_member(ctx, out, f, kv)))
+		return p;
+
+	// Empty objects stay on one line
+	if (ctx->indent && !ctx->nl && (kv->key || f->i))
+		return put_newline(ctx, out, f, !kv->key);
+	ctx->nl = 0;
+
+	if (!kv->key)
+		return pop_frame(ctx, out);
+
+	ctx->state = ST_KEY;
+	if (f->i && ctx->indent)
+		return put_char(ctx, out, '"');
+	if (f->i && ctx->compact)
+		return copy_out(ctx, out, ",\"", 2);
+	if (f->i)
+		return copy_out(ctx, out, ", \"", 3);
+	return put_char(ctx, out, '"');
+}
+
+/*
+ * Write the i-th element of an integer array including its separator, if
+ * there is enough space for both. Returns NULL if not.
+ */
+static char*
+put_elem(struct mtojson_ctx *ctx, char *out, size_t i, uint64_t n, _Bool neg)
+{
+	size_t len = count_digits(n) + neg;
+	size_t sep = i ? 2U - ctx->compact : 0;
+
+	if (ctx->sink == SINK_COUNT){
+		ctx->total += sep + len;
+		return out;
+	}
+	if (ctx->rem_len < sep + len)
+		return NULL;
+	ctx->rem_len -= sep + len;
+
+	return itoa(put_sep(out, sep), len, n, neg);
+}
+
+static char*
+put_selem(struct mtojson_ctx *ctx, char *out, size_t i, int64_t n)
+{
+	if (n < 0)
+		return put_elem(ctx, out, i, -(uint64_t)n, 1);
+	return put_elem(ctx, out, i, (uint64_t)n, 0);
+}
+
+/*
+ * Generate the elements of an integer array in one go, as long as they fit.
+ * The rest is left to gen_step(), e.g. to flush in between. Inlining this
+ * would more than add up the stack usage of both.
+ */
+static NOINLINE char*
+gen_int_elements(struct mtojson_ctx *ctx, char *out, struct json_frame *f)
+{
+	const struct json_array *jar = f->node;
+	size_t i = f->i;
+	char *p;
+
+	switch (jar->type){
+	case t_to_integer: {
+		const int *a = jar->value;
+		for ( ; i < jar->count && (p = put_selem(ctx, out, i, a[i])); i++)
+			out = p;
+		break;
+	}
+	case t_to_uinteger: {
+		const unsigned *a = jar->value;
+		for ( ; i < jar->count && (p = put_elem(ctx, out, i, a[i], 0)); i++)
+			out = p;
+		break;
+	}
+	case t_to_int8: {
+		const int8_t *a = jar->value;
+		for ( ; i < jar->count && (p = put_selem(ctx, out, i, a[i])); i++)
+			out = p;
+		break;
+	}
+	case t_to_int16: {
+		const int16_t *a = jar->value;
+		for ( ; i < jar->count && (p = put_selem(ctx, out, i, a[i])); i++)
+			out = p;
+		break;
+	}
+	case t_to_int32: {
+		const int32_t *a = jar->value;
+		for ( ; i < jar->count && (p = put_selem(ctx, out, i, a[i])); i++)
+			out = p;
+		break;
+	}
+	case t_to_int64: {
+		const int64_t *a = jar->value;
+		for ( ; i < jar->count && (p = put_selem(ctx, out, i, a[i])); i++)
+			out = p;
+		break;
+	}
+	case t_to_uint8: {
+		const uint8_t *a = jar->value;
+		for ( ; i < jar->count && (p = put_elem(ctx, out, i, a[i], 0)); i++)
+			out = p;
+		break;
+	}
+	case t_to_uint16: {
+		const uint16_t *a = jar->value;
+		for ( ; i < jar->count && (p = put_elem(ctx, out, i, a[i], 0)); i++)
+			out = p;
+		break;
+	}
+	case t_to_uint32: {
+		const uint32_t *a = jar->value;
+		for ( ; i < jar->count && (p = put_elem(ctx, out, i, a[i], 0)); i++)
+			out = p;
+		break;
+	}
+	case t_to_uint64: {
+		const uint64_t *a = jar->value;
+		for ( ; i < jar->count && (p = put_elem(ctx, out, i, a[i], 0)); i++)
+			out = p;
+		break;
+	}
+	default:
+		break;
+	}
+	f->i = i;
+	return out;
+}
+
+// Like put_elem() for len characters at p, in quotes if quote is set
+static char*
+put_text_elem(struct mtojson_ctx *ctx, char *out, size_t i, const char *p,
+		size_t len, _Bool quote)
+{
+	size_t sep = i ? 2U - ctx->compact : 0;
+	size_t total = sep + len + 2U * quote;
+
+	if (ctx->sink == SINK_COUNT){
+		ctx->total += total;
+		return out;
+	}
+	if (ctx->rem_len < total)
+		return NULL;
+	ctx->rem_len -= total;
+
+	out = put_sep(out, sep);
+	if (quote)
+		*out++ = '"';
+	memcpy(out, p, len);
+	out += len;
+	if (quote)
+		*out++ = '"';
+	return out;
+}
+
+// Strings that need escaping are left to gen_step()
+static char*
+put_str_elem(struct mtojson_ctx *ctx, char *out, size_t i, const char *p,
+		size_t len)
+{
+	if (clean_run(p, len) != len)
+		return NULL;
+	return put_text_elem(ctx, out, i, p, len, 1);
+}
+
+static char*
+put_fp_elem(struct mtojson_ctx *ctx, char *out, size_t i, double d,
+		_Bool single)
+{
+	size_t sep = i ? 2U - ctx->compact : 0;
+	size_t len;
+
+	if (ctx->sink == SINK_COUNT){
+		len = single ? ftoa(ctx->tmp, (float)d) : dtoa(ctx->tmp, d);
+		ctx->total += sep + len;
+		return out;
+	}
+	if (ctx->rem_len < sep + DOUBLE_STRING_SIZE)
+		return NULL;
+
+	out = put_sep(out, sep);
+	len = single ? ftoa(out, (float)d) : dtoa(out, d);
+	ctx->rem_len -= sep + len;
+	return out + len;
+}
+
+// Like gen_int_elements() for floating point arrays
+static NOINLINE char*
+gen_fp_elements(struct mtojson_ctx *ctx, char *out, struct json_frame *f)
+{
+	const struct json_array *jar = f->node;
+	size_t i = f->i;
+	char *p;
+
+	if (jar->type == t_to_float){
+		const float *a = jar->value;
+		for ( ; i < jar->count && (p = put_fp_elem(ctx, out, i, a[i], 1)); i++)
+			out = p;
+	} else if (jar->type == t_to_double){
+		const double *a = jar->value;
+		for ( ; i < jar->count && (p = put_fp_elem(ctx, out, i, a[i], 0)); i++)
+			out = p;
+	}
+	f->i = i;
+	return out;
+}
+
+// Text of the i-th element of a boolean, string or value array
+static const char*
+elem_text(const struct json_array *jar, size_t i, size_t *len)
+{
+	const struct json_str *str = (const struct json_str *)jar->value + i;
+	const char *p;
+
+	switch (jar->type){
+	case t_to_boolean:
+		p = ((const _Bool *)jar->value)[i] ? "true" : "false";
+		break;
+	case t_to_string:
+	case t_to_value:
+		p = ((const char *const *)jar->value)[i];
+		break;
+	default:
+		*len = str->len;
+		return str->p;
+	}
+	*len = strlen(p);
+	return p;
+}
+
+static NOINLINE char*
+put_text_at(struct mtojson_ctx *ctx, char *out, const struct json_array *jar,
+		size_t i)
+{
+	size_t len;
+	const char *t = elem_text(jar, i, &len);
+
+	if (jar->type == t_to_string || jar->type == t_to_strn)
+		return put_str_elem(ctx, out, i, t, len);
+	return put_text_elem(ctx, out, i, t, len, 0);
+}
+
+/*
+ * Like gen_int_elements() for booleans, strings and values. The scatter-
+ * gather output references long strings, so it takes the slow path.
+ */
+static NOINLINE char*
+gen_text_elements(struct mtojson_ctx *ctx, char *out, struct json_frame *f)
+{
+	const struct json_array *jar = f->node;
+	size_t i = f->i;
+	char *p;
+
+	switch (jar->type){
+	case t_to_boolean:
+	case t_to_string:
+	case t_to_strn:
+	case t_to_value:
+	case t_to_valuen:
+		break;
+	default:
+		return out;
+	}
+	if (ctx->sink == SINK_IOV)
+		return out;
+
+	for ( ; i < jar->count && (p = put_text_at(ctx, out, jar, i)); i++)
+		out = p;
+	f->i = i;
+	return out;
+}
+
+#ifdef MTOJSON_STATS
+// Count the len bytes of the fast loops since element i, but the separators
+static void
+stat_elements(struct mtojson_ctx *ctx, struct json_frame *f, size_t i,
+		size_t len)
+{
+	const struct json_array *jar = f->node;
+	size_t n = f->i - i;
+	size_t seps = i || !n ? n : n - 1;
+
+	stat_move(ctx, t_to_array, jar->type, len - seps * (2U - ctx->compact), n);
+}
+#endif
+
+// The fast loops of all array types, each one leaves the others alone
+static NOINLINE char*
+gen_elements(struct mtojson_ctx *ctx, char *out, struct json_frame *f)
+{
+#ifdef MTOJSON_STATS
+	size_t i = f->i, pos = stat_pos(ctx, out);
+#endif
+	out = gen_int_elements(ctx, out, f);
+	out = gen_fp_elements(ctx, out, f);
+	out = gen_text_elements(ctx, out, f);
+#ifdef MTOJSON_STATS
+	stat_elements(ctx, f, i, stat_pos(ctx, out) - pos);
+#endif
+	return out;
+}
+
+static char*
+gen_element(struct mtojson_ctx *ctx, char *out, struct json_frame *f)
+{
+	const struct json_array *jar = f->node;
+	size_t i = f->i;
+
+#ifdef MTOJSON_THREADS
+	if (!f->i && ctx->nworkers > 1 && jar->count >= MTOJSON_PARALLEL_MIN
+	    && !ctx->indent && !(out = gen_parallel(ctx, out, f)))
+		return NULL;
+#endif
+	// A step of its own, so a chunk of generate_json_parallel() stops before ]
+	if (!ctx->indent)
+		out = gen_elements(ctx, out, f);
+	if (f->i != i)
+		return out;
+
+	_Bool end = f->i == jar->count;
+	if (ctx->indent && !ctx->nl && (!end || f->i))
+		return put_newline(ctx, out, f, end);
+	ctx->nl = 0;
+
+	if (end)
+		return pop_frame(ctx, out);
+
+	ctx->val = array_elem(jar, f->i);
+	if (jar->type == t_to_struct){
+		// One element of stride bytes at a time
+		ctx->elem = *(const struct json_struct *)jar->value;
+		ctx->elem.base = (const char *)ctx->elem.base + f->i * ctx->elem.stride;
+		ctx->val = &ctx->elem;
+	}
+	ctx->type = jar->type;
+	ctx->state = ST_VALUE;
+	if (f->i && !ctx->indent)
+		return copy_out(ctx, out, ", ", 2U - ctx->compact);
+	return out;
+}
+
+static void
+begin_string(struct mtojson_ctx *ctx)
+{
+	if (ctx->type == t_to_strn){
+		const struct json_str *str = ctx->val;
+		ctx->val = str->p;
+		ctx->str_len = str->len;
+	} else {
+		ctx->str_len = strlen(ctx->val);
+	}
+	ctx->state = ST_STRING;
+}
+
+/*
+ * Write the next run of characters that need no escaping, or the escape
+ * sequence of the next character. The closing quote ends the string.
+ */
+static char*
+gen_string(struct mtojson_ctx *ctx, char *out)
+{
+	const char *s = ctx->val;
+	size_t n;
+
+	if (!ctx->str_len){
+		ctx->state = ST_NEXT;
+		return put_char(ctx, out, '"');
+	}
+	n = clean_run(s, ctx->str_len);
+	if (n){
+		ctx->val = s + n;
+		ctx->str_len -= n;
+		return copy_out(ctx, out, s, n);
+	}
+
+	ctx->val = s + 1;
+	ctx->str_len--;
+	if (*s == '"')
+		return copy_out(ctx, out, "\\\"", 2);
+	if (*s == '\\')
+		return copy_out(ctx, out, "\\\\", 2);
+	s = ctrl_escapes[(unsigned char)*s];
+	return copy_out(ctx, out, s, s[1] == 'u' ? 6 : 2);
+}
+
+static void
+begin_binary(struct mtojson_ctx *ctx)
+{
+	const struct json_bin *bin = ctx->val;
+
+	ctx->val = bin->p;
+	ctx->str_len = bin->len;
+	ctx->state = ST_BINARY;
+}
+
+/*
+ * Encode as many of the remaining bytes as fit in one go. With less space
+ * than a single unit of output left it goes through ctx->tmp.
+ */
+static char*
+gen_binary(struct mtojson_ctx *ctx, char *out)
+{
+	const uint8_t *p = ctx->val;
+	_Bool hex = ctx->type == t_to_hex;
+	size_t group = hex ? 1 : 3;
+	size_t width = hex ? 2 : 4;
+	size_t units = (ctx->str_len + group - 1) / group;
+	size_t n;
+
+	if (!ctx->str_len){
+		ctx->state = ST_NEXT;
+		return put_char(ctx, out, '"');
+	}
+	if (ctx->sink == SINK_COUNT){
+		ctx->str_len = 0;
+		return copy_out(ctx, out, NULL, units * width);
+	}
+
+	if (units > ctx->rem_len / width)
+		units = ctx->rem_len / width;
+	n = units ? units * group : group;
+	if (n > ctx->str_len)
+		n = ctx->str_len;
+	ctx->val = p + n;
+	ctx->str_len -= n;
+
+	if (!units){
+		size_t len = hex ? hex_encode(ctx->tmp, p, n) : base64_encode(ctx->tmp, p, n);
+		return copy_out(ctx, out, ctx->tmp, len);
+	}
+	ctx->rem_len -= units * width;
+	return out + (hex ? hex_encode(out, p, n) : base64_encode(out, p, n));
+}
+
+/*
+ * Only buffers get the JSON of a cache in one piece, pretty printing depends
+ * on the depth. Workers of generate_json_parallel() may share caches with
+ * other threads, so they only read them.
+ */
+static _Bool
+fills_caches(const struct mtojson_ctx *ctx)
+{
+#ifdef MTOJSON_THREADS
+	if (ctx->worker)
+		return 0;
+#endif
+	return ctx->sink == SINK_BUFFER && !ctx->indent;
+}
+
+/*
+ * Copy the JSON of a cache that is still valid for the output options, or
+ * open its value and fill the cache when it is closed.
+ */
+static NOINLINE char*
+gen_cached(struct mtojson_ctx *ctx, char *out)
+{
+	struct json_cache *c = (struct json_cache *)(uintptr_t)ctx->val;
+	char *start = out;
+
+	if (c->len && c->seen == *c->gen && c->compact == ctx->compact
+	    && !ctx->indent){
+		ctx->state = ST_NEXT;
+		return copy_out(ctx, out, c->buf, c->len);
+	}
+
+	ctx->val = c->value;
+	ctx->type = c->type;
+	if (c->type != t_to_object && c->type != t_to_array
+	    && c->type != t_to_struct)
+		return out;
+	if (!(out = push_frame(ctx, out)))
+		return NULL;
+	if (fills_caches(ctx)){
+		ctx->stack[ctx->depth - 1].cache = c;
+		ctx->stack[ctx->depth - 1].start = start;
+	}
+	return out;
+}
+
+// Record the value as a template slot instead of generating it
+static char*
+add_slot(struct mtojson_ctx *ctx, char *out)
+{
+	struct json_template *tpl = ctx->tpl;
+
+	if (tpl->count == tpl->max_slots){
+		ctx->error = e_json_no_space;
+		return NULL;
+	}
+
+	struct json_slot *slot = &tpl->slots[tpl->count++];
+	slot->value = ctx->val;
+	slot->type = ctx->type;
+	slot->offset = (size_t)(out - ctx->buf);
+	slot->depth = ctx->depth;
+	slot->nested_object_depth = ctx->nested_object_depth;
+	ctx->state = ST_NEXT;
+	return out;
+}
+
+/*
+ * Do one step of generation, writing at most one piece of JSON. This keeps
+ * the cursor exact when the output runs full in between.
+ */
+static NOINLINE char*
+gen_step(struct mtojson_ctx *ctx, char *out)
+{
+	// Only ST_VALUE and ST_NEXT can happen outside of the outermost object
+	struct json_frame *f = ctx->depth ? &ctx->stack[ctx->depth - 1] : NULL;
+	const struct json_kv *kv;
+
+	if (ctx->pad)
+		return put_pad(ctx, out);
+
+	switch (ctx->state){
+	case ST_VALUE:
+		if (ctx->tpl && ctx->type != t_to_object && ctx->type != t_to_struct)
+			return add_slot(ctx, out);
+		if (ctx->type == t_to_cached)
+			return gen_cached(ctx, out);
+		if (ctx->type == t_to_object || ctx->type == t_to_array
+		    || ctx->type == t_to_struct)
+			return push_frame(ctx, out);
+		if (ctx->type == t_to_string || ctx->type == t_to_strn){
+			begin_string(ctx);
+			return put_char(ctx, out, '"');
+		}
+		if (ctx->type == t_to_base64 || ctx->type == t_to_hex){
+			begin_binary(ctx);
+			return put_char(ctx, out, '"');
+		}
+		ctx->state = ST_NEXT;
+		return gen_scalar(ctx, out);
+	case ST_STRING:
+		return gen_string(ctx, out);
+	case ST_BINARY:
+		return gen_binary(ctx, out);
+	case ST_MEMBER:
+		return gen_member(ctx, out, f);
+	case ST_KEY:
+		kv = f->type == t_to_struct ? &ctx->member : f->node;
+		ctx->state = ST_COLON;
+		return copy_out(ctx, out, kv->key,
+				kv->key_len ? kv->key_len : strlen(kv->key));
+	case ST_COLON:
+		kv = f->type == t_to_struct ? &ctx->member : f->node;
+		ctx->val = kv->value;
+		ctx->type = kv->type;
+		ctx->state = ST_VALUE;
+		return copy_out(ctx, out, "\": ", 3U - ctx->compact);
+	case ST_ELEMENT:
+		return gen_element(ctx, out, f);
+	case ST_NEXT:
+		if (ctx->depth == 0){
+			ctx->state = ST_DONE;
+			return out;
+		}
+		f->i++;
+		if (f->type == t_to_object)
+			f->node = (const struct json_kv *)f->node + 1;
+		if (f->type == t_to_struct)
+			f->node = (const struct json_field *)f->node + 1;
+		ctx->state = f->type == t_to_array ? ST_ELEMENT : ST_MEMBER;
+		return out;
+	default:
+		return out;
+	}
+}
+
+#ifdef MTOJSON_STATS
+static NOINLINE enum json_value_type
+stat_type(struct mtojson_ctx *ctx)
+{
+	if (ctx->state == ST_VALUE || ctx->state == ST_STRING
+	    || ctx->state == ST_BINARY)
+		return ctx->type;
+	return ctx->depth ? ctx->stack[ctx->depth - 1].type : t_to_object;
+}
+
+// gen_step() and the accounting of what it wrote
+static NOINLINE char*
+stat_step(struct mtojson_ctx *ctx, char *out)
+{
+	enum json_value_type type = stat_type(ctx);
+	size_t pos = stat_pos(ctx, out);
+
+	// Every value, but not the records of a batch
+	if (ctx->state == ST_VALUE && (ctx->depth || type != t_to_object))
+		ctx->stats.fields++;
+
+	out = gen_step(ctx, out);
+	if (!out)
+		ctx->stats.fail_offset = pos;
+	else
+		ctx->stats.bytes[type] += stat_pos(ctx, out) - pos;
+	return out;
+}
+#define next_step stat_step
+#else
+#define next_step gen_step
+#endif
+
+static void
+init_ctx(struct mtojson_ctx *ctx, int sink, char *buf, size_t len,
+		const struct json_kv *kv)
+{
+	ctx->sink = sink;
+	ctx->buf = buf;
+	ctx->buf_len = len;
+	ctx->rem_len = len;
+	ctx->total = 0;
+	ctx->nested_object_depth = 0;
+	ctx->error = e_json_ok;
+
+	ctx->depth = 0;
+	ctx->state = ST_VALUE;
+	ctx->val = kv;
+	ctx->type = t_to_object;
+	ctx->pend_len = 0;
+	ctx->tpl = NULL;
+	ctx->pad = 0;
+	ctx->nl = 0;
+#ifdef MTOJSON_THREADS
+	ctx->nworkers = 0;
+	ctx->worker = 0;
+#endif
+#ifdef MTOJSON_STATS
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif
+}
+
+static char*
+gen_json(struct mtojson_ctx *ctx, char *out)
+{
+	while (out && ctx->state != ST_DONE)
+		out = next_step(ctx, out);
+	return out;
+}
+
+// NUL terminate the JSON of a buffer context, out is NULL after an error
+static size_t
+finish_json(struct mtojson_ctx *ctx, char *out)
+{
+	if (!out)
+		return 0;
+	if (!(out = reduce_rem_len(ctx, out, 1))){ // 1 -> \0
+#ifdef MTOJSON_STATS
+		ctx->stats.fail_offset = ctx->buf_len - ctx->rem_len;
+#endif
+		return 0;
+	}
+	*out = '\0';
+
+	return (size_t)(out - ctx->buf);
+}
+
+size_t
+generate_json_r(struct mtojson_ctx *ctx, char *out, const struct json_kv *kv,
+		size_t len)
+{
+	init_ctx(ctx, SINK_BUFFER, out, len, kv);
+	return finish_json(ctx, gen_json(ctx, out));
+}
+
+#ifdef MTOJSON_THREADS
+// Set up w to continue the array of ctx with the elements of its part
+static void
+begin_worker(struct mtojson_ctx *ctx, struct json_worker *w, int sink,
+		char *out, size_t len)
+{
+	struct mtojson_ctx *wctx = &w->ctx;
+
+	init_ctx(wctx, sink, out, len, NULL);
+	wctx->compact = ctx->compact;
+	wctx->indent = 0;
+	wctx->user = ctx->user;
+	wctx->worker = 1;
+#ifdef MTOJSON_STATS
+	// Measuring is not generating
+	wctx->hook = sink == SINK_BUFFER ? ctx->hook : NULL;
+#endif
+	wctx->nested_object_depth = ctx->nested_object_depth;
+	wctx->depth = ctx->depth;
+	wctx->stack[ctx->depth - 1].node = &w->part;
+	wctx->stack[ctx->depth - 1].i = w->first;
+	wctx->stack[ctx->depth - 1].type = t_to_array;
+	wctx->stack[ctx->depth - 1].cache = NULL;
+	wctx->state = ST_ELEMENT;
+}
+
+// Generate the chunk up to the closing bracket of part, which is left out
+static void*
+run_worker(void *arg)
+{
+	struct json_worker *w = arg;
+	struct mtojson_ctx *ctx = &w->ctx;
+	int depth = ctx->depth;
+	const struct json_frame *f = &ctx->stack[depth - 1];
+	char *out = ctx->buf;
+
+	while (out && !(ctx->depth == depth && ctx->state == ST_ELEMENT
+	                && f->i == w->part.count))
+		out = next_step(ctx, out);
+	if (ctx->sink == SINK_COUNT)
+		w->len = ctx->total;
+	return NULL;
+}
+
+// Run all but the first worker in threads of their own, if possible
+static NOINLINE enum json_error
+run_workers(struct json_worker *workers, unsigned n)
+{
+	for (unsigned k = 1; k < n; k++)
+		workers[k].started = !pthread_create(&workers[k].thread, NULL,
+				run_worker, &workers[k]);
+	run_worker(&workers[0]);
+
+	enum json_error error = workers[0].ctx.error;
+	for (unsigned k = 1; k < n; k++){
+		if (workers[k].started)
+			pthread_join(workers[k].thread, NULL);
+		else
+			run_worker(&workers[k]);
+		if (!error)
+			error = workers[k].ctx.error;
+	}
+	return error;
+}
+
+// Split jar into one chunk per worker and set them up to measure it
+static NOINLINE void
+split_array(struct mtojson_ctx *ctx, const struct json_array *jar)
+{
+	struct json_worker *w = ctx->workers;
+	unsigned n = ctx->nworkers;
+
+	for (unsigned k = 0; k < n; k++){
+		w[k].part = *jar;
+		w[k].part.count = k + 1 == n ? jar->count : jar->count / n * (k + 1);
+		w[k].first = jar->count / n * k;
+		begin_worker(ctx, &w[k], SINK_COUNT, w[k].ctx.tmp, 0);
+	}
+}
+
+/*
+ * Set up the workers to generate their chunks one after the other from out on.
+ * Returns the length of all of them, nothing is set up if they don't fit.
+ */
+static NOINLINE size_t
+place_chunks(struct mtojson_ctx *ctx, char *out)
+{
+	struct json_worker *w = ctx->workers;
+	size_t len = 0;
+
+	for (unsigned k = 0; k < ctx->nworkers; k++)
+		len += w[k].len;
+	if (ctx->rem_len < len)
+		return len;
+
+	for (unsigned k = 0; k < ctx->nworkers; k++){
+		begin_worker(ctx, &w[k], SINK_BUFFER, out, w[k].len);
+		out += w[k].len;
+	}
+	return len;
+}
+
+#ifdef MTOJSON_STATS
+/*
+ * Add the statistics of the generated chunks. stat_step() counts all of their
+ * len bytes for the array, the workers know better.
+ */
+static NOINLINE void
+add_worker_stats(struct mtojson_ctx *ctx, size_t len)
+{
+	ctx->stats.bytes[t_to_array] -= len;
+	for (unsigned k = 0; k < ctx->nworkers; k++){
+		const struct json_stats *s = &ctx->workers[k].ctx.stats;
+
+		for (size_t t = 0; t <= t_to_cached; t++)
+			ctx->stats.bytes[t] += s->bytes[t];
+		ctx->stats.fields += s->fields;
+		if (s->peak_depth > ctx->stats.peak_depth)
+			ctx->stats.peak_depth = s->peak_depth;
+	}
+}
+#endif
+
+/*
+ * Measure the chunks of the array of f in parallel and generate them at the
+ * offsets their lengths add up to. The closing bracket is left to the caller.
+ */
+static NOINLINE char*
+gen_parallel(struct mtojson_ctx *ctx, char *out, struct json_frame *f)
+{
+	const struct json_array *jar = f->node;
+	size_t len;
+
+	split_array(ctx, jar);
+	if ((ctx->error = run_workers(ctx->workers, ctx->nworkers)))
+		return NULL;
+
+	if ((len = place_chunks(ctx, out)) > ctx->rem_len){
+		ctx->error = e_json_no_space;
+		return NULL;
+	}
+	if ((ctx->error = run_workers(ctx->workers, ctx->nworkers)))
+		return NULL;
+
+#ifdef MTOJSON_STATS
+	add_worker_stats(ctx, len);
+#endif
+	ctx->rem_len -= len;
+	f->i = jar->count;
+	return out + len;
+}
+
+size_t
+generate_json_parallel(struct mtojson_ctx *ctx, char *out,
+		const struct json_kv *kv, size_t len, struct json_worker *workers,
+		unsigned n)
+{
+	init_ctx(ctx, SINK_BUFFER, out, len, kv);
+	ctx->workers = workers;
+	ctx->nworkers = n;
+	return finish_json(ctx, gen_json(ctx, out));
+}
+#endif
+
+size_t
+generate_json_stream(struct mtojson_ctx *ctx, const struct json_kv *kv,
+		char *buf, size_t len, json_flush_fn flush)
+{
+	init_ctx(ctx, SINK_STREAM, buf, len, kv);
+	ctx->flush = flush;
+
+	char *out = gen_json(ctx, buf);
+	if (!out || !flush_buf(ctx, out))
+		return 0;
+
+	return ctx->total;
+}
+
+size_t
+generate_json_iov(struct mtojson_ctx *ctx, const struct json_kv *kv,
+		char *scratch, size_t len, struct json_iovec *iov, size_t iovcnt,
+		size_t threshold)
+{
+	init_ctx(ctx, SINK_IOV, scratch, len, kv);
+	ctx->iov = iov;
+	ctx->iov_cnt = 0;
+	ctx->iov_max = iovcnt;
+	ctx->threshold = threshold ? threshold : 1;
+	ctx->seg = scratch;
+
+	char *out = gen_json(ctx, scratch);
+	if (!out || (out != ctx->seg
+	             && !add_iov(ctx, ctx->seg, (size_t)(out - ctx->seg))))
+		return 0;
+
+	return ctx->iov_cnt;
+}
+
+size_t
+json_measure_r(struct mtojson_ctx *ctx, const struct json_kv *kv)
+{
+	init_ctx(ctx, SINK_COUNT, ctx->tmp, 0, kv);
+
+	if (!gen_json(ctx, ctx->tmp))
+		return 0;
+
+	return ctx->total + 1; // 1 -> \0
+}
+
+void
+json_gen_begin(struct mtojson_ctx *ctx, const struct json_kv *kv)
+{
+	init_ctx(ctx, SINK_RESUME, NULL, 0, kv);
+}
+
+size_t
+json_gen_next(struct mtojson_ctx *ctx, char *buf, size_t len)
+{
+	char *out = buf;
+
+	if (ctx->error)
+		return 0;
+
+	ctx->buf_len = len;
+	ctx->rem_len = len;
+	if (ctx->pend_len){
+		size_t n = ctx->pend_len;
+		ctx->pend_len = 0;
+		out = copy_out(ctx, out, ctx->pend, n);
+	}
+
+	while (out && !ctx->pend_len && ctx->state != ST_DONE)
+		out = next_step(ctx, out);
+
+	if (!out)
+		return 0;
+	ctx->total += len - ctx->rem_len;
+	return len - ctx->rem_len;
+}
+
+/*
+ * Append a record to the batch, preceded by its separator. If it doesn't fit
+ * the output is left as it was.
+ */
+static NOINLINE char*
+batch_record(struct mtojson_ctx *ctx, char *out, const struct json_kv *kv,
+		size_t i, enum json_batch_mode mode)
+{
+	char *mark = out;
+	size_t rem_len = ctx->rem_len;
+
+	if (i && mode == m_json_array)
+		out = copy_out(ctx, out, ", ", 2U - ctx->compact);
+	ctx->val = kv;
+	ctx->type = t_to_object;
+	ctx->state = ST_VALUE;
+	out = gen_json(ctx, out);
+	if (out && mode == m_json_ndjson)
+		out = put_char(ctx, out, '\n');
+	if (out)
+		return out;
+
+	ctx->rem_len = rem_len;
+	return mark;
+}
+
+size_t
+generate_json_batch_r(struct mtojson_ctx *ctx, char *out,
+		const struct json_kv *const records[], size_t n, size_t len,
+		enum json_batch_mode mode)
+{
+	// Space for the brackets and the \0
+	size_t tail = mode == m_json_array ? 3 : 1;
+	unsigned indent = ctx->indent;
+	size_t i;
+
+	init_ctx(ctx, SINK_BUFFER, out, len, NULL);
+	if (len < tail){
+		ctx->error = e_json_no_space;
+		return 0;
+	}
+	ctx->rem_len -= tail;
+	if (mode == m_json_array)
+		*out++ = '[';
+
+	// A record per line, the option is kept for the next call
+	if (mode == m_json_ndjson)
+		ctx->indent = 0;
+	for (i = 0; i < n && !ctx->error; i++)
+		out = batch_record(ctx, out, records[i], i, mode);
+	ctx->indent = indent;
+	if (ctx->error)
+		i--;
+
+	if (mode == m_json_array)
+		*out++ = ']';
+	*out = '\0';
+	return i;
+}
+
+size_t
+json_template_compile(struct mtojson_ctx *ctx, struct json_template *tpl,
+		const struct json_kv *kv)
+{
+	size_t len;
+
+	tpl->count = 0;
+	init_ctx(ctx, SINK_BUFFER, tpl->skel, tpl->skel_len, kv);
+	ctx->tpl = tpl;
+	len = finish_json(ctx, gen_json(ctx, tpl->skel));
+	ctx->tpl = NULL;
+
+	tpl->skel_len = len;
+	return len;
+}
+
+// Pad the value generated since start with spaces and record where it is
+static char*
+pad_slot(struct mtojson_ctx *ctx, char *out, char *start,
+		struct json_patch_slot *ps)
+{
+	size_t len = (size_t)(out - start);
+
+	ps->offset = (size_t)(start - ctx->buf);
+	ps->width = len;
+	if (ps->width < fixed_width(ps->type))
+		ps->width = fixed_width(ps->type);
+
+	out = reduce_rem_len(ctx, out, ps->width - len);
 	if (!out)
+		return NULL;
+	memset(out, ' ', ps->width - len);
+	return out + ps->width - len;
+}
+
+static NOINLINE char*
+render_slot(struct mtojson_ctx *ctx, char *out, const struct json_slot *slot,
+		struct json_patch_slot *ps)
+{
+	char *start = out;
+
+	// Nested as when compiled, for the limits and the indentation
+	ctx->depth = slot->depth;
+	ctx->nested_object_depth = slot->nested_object_depth;
+	ctx->val = slot->value;
+	ctx->type = slot->type;
+	ctx->state = ST_VALUE;
+	while (out && !(ctx->state == ST_NEXT && ctx->depth == slot->depth))
+		out = next_step(ctx, out);
+	if (!ps || !out)
+		return out;
+
+	ps->type = slot->type;
+	return pad_slot(ctx, out, start, ps);
+}
+
+static size_t
+render(struct mtojson_ctx *ctx, const struct json_template *tpl, char *out,
+		size_t len, struct json_patch_slot *ps)
+{
+	size_t pos = 0;
+
+	init_ctx(ctx, SINK_BUFFER, out, len, NULL);
+	ctx->state = ST_DONE;
+	// The skeleton before each slot and after the last one
+	for (size_t i = 0; i <= tpl->count && out; i++){
+		size_t end = i < tpl->count ? tpl->slots[i].offset : tpl->skel_len;
+
+		out = copy_out(ctx, out, tpl->skel + pos, end - pos);
+		pos = end;
+#ifdef MTOJSON_STATS
+		if (!out)
+			ctx->stats.fail_offset = ctx->buf_len - ctx->rem_len;
+#endif
+		if (out && i < tpl->count)
+			out = render_slot(ctx, out, &tpl->slots[i], ps ? &ps[i] : NULL);
+	}
+	return finish_json(ctx, out);
+}
+
+size_t
+json_template_render(struct mtojson_ctx *ctx, const struct json_template *tpl,
+		char *out, size_t len)
+{
+	return render(ctx, tpl, out, len, NULL);
+}
+
+size_t
+json_template_render_fixed(struct mtojson_ctx *ctx,
+		const struct json_template *tpl, char *out, size_t len,
+		struct json_patch_slot *ps)
+{
+	return render(ctx, tpl, out, len, ps);
+}
+
+int
+json_patch(char *buf, const struct json_patch_slot *ps, const void *value)
+{
+	char *dst = buf + ps->offset;
+	size_t len = format_fixed(dst, ps->type, value);
+
+	if (!len)
+		return -1;
+	memset(dst + len, ' ', ps->width - len);
+	return 0;
+}
+
+// Alignment of builder allocations, enough for all values
+#define BUILDER_ALIGN sizeof(union { uint64_t u; double d; void *p; })
+
+void
+json_builder_init(struct json_builder *b, void *arena, size_t size)
+{
+	b->arena = arena;
+	b->size = size;
+	b->used = 0;
+}
+
+void
+json_builder_reset(struct json_builder *b)
+{
+	b->used = 0;
+}
+
+static NOINLINE void*
+builder_alloc(struct json_builder *b, size_t size)
+{
+	uintptr_t next = (uintptr_t)(b->arena + b->used);
+	size_t pad = (size_t)(-next & (BUILDER_ALIGN - 1));
+	size_t rem = b->size - b->used;
+
+	if (rem < pad || rem - pad < size)
+		return NULL;
+	b->used += pad + size;
+	return b->arena + b->used - size;
+}
+
+void*
+json_builder_alloc(struct json_builder *b, size_t size)
+{
+	return builder_alloc(b, size);
+}
+
+struct json_obj*
+json_obj_new(struct json_builder *b, size_t max)
+{
+	struct json_obj *obj = builder_alloc(b, sizeof(*obj));
+	struct json_kv *kv = NULL;
+
+	if (obj && max < SIZE_MAX / sizeof(*kv))
+		kv = builder_alloc(b, (max + 1) * sizeof(*kv));
+	if (!kv)
+		return NULL;
+
+	memset(kv, 0, (max + 1) * sizeof(*kv));
+	obj->kv = kv;
+	obj->count = 0;
+	obj->max = max;
+	return obj;
+}
+
+int
+json_obj_add(struct json_obj *obj, const char *key, enum json_value_type type,
+		const void *value)
+{
+	struct json_kv *kv;
+
+	if (obj->count == obj->max)
+		return -1;
+	kv = &obj->kv[obj->count++];
+	kv->key = (char *)(uintptr_t)key;
+	kv->value = value;
+	kv->type = type;
+	return 0;
+}
+
+// Space for the value of the next member of obj
+static void*
+new_value(struct json_builder *b, struct json_obj *obj, size_t size)
+{
+	if (obj->count == obj->max)
+		return NULL;
+	return builder_alloc(b, size);
+}
+
+int
+json_obj_add_int(struct json_builder *b, struct json_obj *obj,
+		const char *key, int64_t value)
+{
+	int64_t *p = new_value(b, obj, sizeof(*p));
+
+	if (!p)
+		return -1;
+	*p = value;
+	return json_obj_add(obj, key, t_to_int64, p);
+}
+
+int
+json_obj_add_uint(struct json_builder *b, struct json_obj *obj,
+		const char *key, uint64_t value)
+{
+	uint64_t *p = new_value(b, obj, sizeof(*p));
+
+	if (!p)
+		return -1;
+	*p = value;
+	return json_obj_add(obj, key, t_to_uint64, p);
+}
+
+int
+json_obj_add_bool(struct json_builder *b, struct json_obj *obj,
+		const char *key, _Bool value)
+{
+	_Bool *p = new_value(b, obj, sizeof(*p));
+
+	if (!p)
+		return -1;
+	*p = value;
+	return json_obj_add(obj, key, t_to_boolean, p);
+}
+
+int
+json_obj_add_double(struct json_builder *b, struct json_obj *obj,
+		const char *key, double value)
+{
+	double *p = new_value(b, obj, sizeof(*p));
+
+	if (!p)
+		return -1;
+	*p = value;
+	return json_obj_add(obj, key, t_to_double, p);
+}
+
+// Stored as t_to_strn, so the length is not counted again
+int
+json_obj_add_string(struct json_builder *b, struct json_obj *obj,
+		const char *key, const char *value)
+{
+	struct json_str *str = new_value(b, obj, sizeof(*str));
+	size_t len = strlen(value);
+	char *p = str ? builder_alloc(b, len) : NULL;
+
+	if (!p)
+		return -1;
+	memcpy(p, value, len);
+	str->p = p;
+	str->len = len;
+	return json_obj_add(obj, key, t_to_strn, str);
+}
+
+int
+json_obj_add_obj(struct json_obj *obj, const char *key,
+		const struct json_obj *child)
+{
+	return json_obj_add(obj, key, t_to_object, child->kv);
+}
+
+int
+json_obj_add_array(struct json_builder *b, struct json_obj *obj,
+		const char *key, const void *values, size_t count,
+		enum json_value_type type)
+{
+	struct json_array *jar = new_value(b, obj, sizeof(*jar));
+
+	if (!jar)
+		return -1;
+	jar->value = values;
+	jar->count = count;
+	jar->type = type;
+	return json_obj_add(obj, key, t_to_array, jar);
+}
+
+// Size of a value json_flatten() copies, 0 for references and containers
+static size_t
+value_size(enum json_value_type type)
+{
+	switch (type){
+	case t_to_boolean:
+		return sizeof(_Bool);
+	case t_to_integer:
+		return sizeof(int);
+	case t_to_uinteger:
+		return sizeof(unsigned);
+	case t_to_int8:
+	case t_to_uint8:
+		return sizeof(int8_t);
+	case t_to_int16:
+	case t_to_uint16:
+		return sizeof(int16_t);
+	case t_to_int32:
+	case t_to_uint32:
+		return sizeof(int32_t);
+	case t_to_int64:
+	case t_to_uint64:
+		return sizeof(int64_t);
+	case t_to_float:
+		return sizeof(float);
+	case t_to_double:
+		return sizeof(double);
+	case t_to_strn:
+	case t_to_valuen:
+		return sizeof(struct json_str);
+	case t_to_base64:
+	case t_to_hex:
+		return sizeof(struct json_bin);
+	default:
 		return 0;
+	}
+}
+
+// Copy the members of kv and their values, followed by nothing else
+static NOINLINE struct json_kv*
+copy_members(struct json_builder *b, const struct json_kv *kv)
+{
+	size_t n = 0;
+	struct json_kv *dst;
+
+	while (kv[n].key)
+		n++;
+	if (!(dst = builder_alloc(b, (n + 1) * sizeof(*dst))))
+		return NULL;
+	memcpy(dst, kv, (n + 1) * sizeof(*dst));
+
+	for (size_t i = 0; i < n; i++){
+		size_t size = value_size(dst[i].type);
+		void *p = size ? builder_alloc(b, size) : NULL;
+
+		if (size && !p)
+			return NULL;
+		if (size){
+			memcpy(p, dst[i].value, size);
+			dst[i].value = p;
+		}
+		if (!dst[i].key_len)
+			dst[i].key_len = strlen(dst[i].key);
+	}
+	return dst;
+}
+
+// Arrays of objects and arrays get a copy of their pointers to repoint them
+static NOINLINE struct json_array*
+copy_array(struct json_builder *b, const struct json_array *jar)
+{
+	struct json_array *dst = builder_alloc(b, sizeof(*dst));
+	const void **table;
+
+	if (!dst)
+		return NULL;
+	*dst = *jar;
+	if (jar->type != t_to_object && jar->type != t_to_array)
+		return dst;
+
+	if (jar->count > SIZE_MAX / sizeof(*table)
+	    || !(table = builder_alloc(b, jar->count * sizeof(*table))))
+		return NULL;
+	memcpy(table, jar->value, jar->count * sizeof(*table));
+	dst->value = table;
+	return dst;
+}
+
+// Copy the object or array at *value and continue with its children
+static NOINLINE void
+flatten_child(struct mtojson_ctx *ctx, struct json_builder *b,
+		const void **value, enum json_value_type type)
+{
+	const void *node;
+
+	if (type == t_to_object)
+		node = copy_members(b, *value);
+	else if (type == t_to_array)
+		node = copy_array(b, *value);
+	else
+		return;
 
-	return (size_t)(out - start);
+	if (!node){
+		ctx->error = e_json_no_space;
+		return;
+	}
+	*value = node;
+	if (type == t_to_array && ((const struct json_array *)node)->type != t_to_object
+	    && ((const struct json_array *)node)->type != t_to_array)
+		return;
+
+	if (ctx->depth == MAX_NESTING_DEPTH){
+		ctx->error = e_json_max_depth;
+		return;
+	}
+	ctx->stack[ctx->depth].node = node;
+	ctx->stack[ctx->depth].i = 0;
+	ctx->stack[ctx->depth++].type = type;
+}
+
+// Visit the next child of the innermost container, the copies are ours
+static void
+flatten_step(struct mtojson_ctx *ctx, struct json_builder *b)
+{
+	struct json_frame *f = &ctx->stack[ctx->depth - 1];
+
+	if (f->type == t_to_object){
+		struct json_kv *kv = (struct json_kv *)(uintptr_t)f->node + f->i++;
+
+		if (!kv->key)
+			ctx->depth--;
+		else
+			flatten_child(ctx, b, &kv->value, kv->type);
+		return;
+	}
+
+	const struct json_array *jar = f->node;
+	const void **table = (const void **)(uintptr_t)jar->value;
+
+	if (f->i == jar->count)
+		ctx->depth--;
+	else
+		flatten_child(ctx, b, &table[f->i++], jar->type);
+}
+
+const struct json_kv*
+json_flatten(struct mtojson_ctx *ctx, struct json_builder *b,
+		const struct json_kv *kv)
+{
+	const void *root = kv;
+
+	ctx->error = e_json_ok;
+	ctx->depth = 0;
+	flatten_child(ctx, b, &root, t_to_object);
+	while (ctx->depth && !ctx->error)
+		flatten_step(ctx, b);
+
+	return ctx->error ? NULL : root;
+}
+
+// Context of the non-reentrant functions
+static struct mtojson_ctx static_ctx;
+
+size_t
+generate_json(char *out, const struct json_kv *kv, size_t len)
+{
+	return generate_json_r(&static_ctx, out, kv, len);
+}
+
+size_t
+generate_json_batch(char *out, const struct json_kv *const records[], size_t n,
+		size_t len, enum json_batch_mode mode)
+{
+	return generate_json_batch_r(&static_ctx, out, records, n, len, mode);
+}
+
+size_t
+json_measure(const struct json_kv *kv)
+{
+	return json_measure_r(&static_ctx, kv);
 }
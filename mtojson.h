@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#ifdef MTOJSON_THREADS
+#include <pthread.h>
+#endif
+
 enum json_value_type {
 	t_to_array,
 	t_to_boolean,
@@ -12,19 +16,413 @@ enum json_value_type {
 	t_to_string,
 	t_to_uinteger,
 	t_to_value,
+	t_to_int8,
+	t_to_int16,
+	t_to_int32,
+	t_to_int64,
+	t_to_uint8,
+	t_to_uint16,
+	t_to_uint32,
+	t_to_uint64,
+	t_to_float,
+	t_to_double,
+	t_to_strn,
+	t_to_valuen,
+	t_to_base64,
+	t_to_hex,
+	t_to_null,
+	t_to_struct,
+	t_to_cached,
 };
 
+/*
+ * A key_len of 0 means key is NUL terminated, JSON_KEY() fills in the length
+ * of a string literal. If present is set, the member is left out while
+ * *present is false. t_to_null needs no value.
+ */
 struct json_kv {
 	char *key;
 	const void *value;
 	enum json_value_type type;
+	size_t key_len;
+	const _Bool *present;
+};
+
+#define JSON_KEY(s) .key = s, .key_len = sizeof(s) - 1
+
+// Value of t_to_strn and t_to_valuen, p needs no terminating NUL
+struct json_str {
+	const char *p;
+	size_t len;
 };
 
+// Value of t_to_base64 and t_to_hex, written as encoded string
+struct json_bin {
+	const void *p;
+	size_t len;
+};
+
+// max is only read by json_parse(), the number of elements there is room for
 struct json_array {
 	const void *value;
 	size_t count;
 	enum json_value_type type;
+	size_t max;
+};
+
+/*
+ * A member of a C struct at offset, written as if a json_kv pointed there.
+ * Members of type t_to_struct are written as object of their fields. The size
+ * of the member is only needed to parse strings into char arrays.
+ */
+struct json_field {
+	char *key;
+	size_t offset;
+	enum json_value_type type;
+	size_t key_len;
+	const struct json_field *fields;
+	size_t size;
+};
+
+// A field named like the member m of struct s
+#define JSON_FIELD(s, m, t) \
+	.key = #m, .key_len = sizeof(#m) - 1, .offset = offsetof(s, m), .type = t, \
+	.size = sizeof(((s *)0)->m)
+
+/*
+ * Value of t_to_struct: an object of the NULL terminated fields of the struct
+ * at base. Arrays of t_to_struct point to a single json_struct, their count
+ * elements are stride bytes apart from base.
+ */
+struct json_struct {
+	const struct json_field *fields;
+	const void *base;
+	size_t stride;
+};
+
+/*
+ * Value of t_to_cached: the object, array or struct at value, whose JSON is
+ * kept in the caller provided buf of size bytes. As long as *gen stays the
+ * same it is copied from there, so bump *gen whenever anything below value
+ * changes, also for every cache around it. The rest is set by generation,
+ * zero it once. Caches are filled by the buffer outputs without indentation,
+ * they don't fit if len stays 0.
+ */
+struct json_cache {
+	const void *value;
+	enum json_value_type type;
+	const unsigned *gen;
+	char *buf;
+	size_t size;
+
+	size_t len;
+	unsigned seen;
+	_Bool compact;
 };
 
+#ifndef MAX_NESTING_DEPTH
+#define MAX_NESTING_DEPTH 16
+#endif
+
+enum json_error {
+	e_json_ok,
+	e_json_no_space,
+	e_json_max_depth,
+	e_json_flush,
+};
+
+struct mtojson_ctx;
+struct json_worker;
+
+// A value of a template, rendered at offset of the skeleton and as nested
+struct json_slot {
+	const void *value;
+	enum json_value_type type;
+	size_t offset;
+	int depth;
+	int nested_object_depth;
+};
+
+/*
+ * The fixed parts of a JSON object and where its values go. The caller sets
+ * skel, skel_len, slots and max_slots, json_template_compile() the rest.
+ */
+struct json_template {
+	char *skel;
+	size_t skel_len;
+	struct json_slot *slots;
+	size_t max_slots;
+	size_t count;
+};
+
+/*
+ * Called by generate_json_stream() whenever its buffer is full and once at the
+ * end. Return non-zero to abort generation.
+ */
+typedef int (*json_flush_fn)(struct mtojson_ctx *ctx, const char *buf, size_t len);
+
+// Same layout as struct iovec on POSIX systems
+struct json_iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+#ifdef MTOJSON_STATS
+/*
+ * Called when an object or array begins and when it ends, depth is 1 for the
+ * outermost object. E.g. to read a cycle counter.
+ */
+typedef void (*json_hook_fn)(struct mtojson_ctx *ctx,
+		enum json_value_type type, int depth, _Bool end);
+
+/*
+ * Collected by every call. Keys, separators and brackets count as bytes of
+ * t_to_object and t_to_array, fields are members and array elements.
+ */
+struct json_stats {
+	size_t bytes[t_to_cached + 1];
+	size_t fields;
+	int peak_depth;
+	// Bytes of JSON before the write that failed, ctx->error tells why
+	size_t fail_offset;
+};
+#endif
+
+/*
+ * Position inside an object or array, used by json_gen_next(). For objects
+ * node is the current member and i the number of members written before,
+ * structs are at base. A cache is filled from start on once it is closed.
+ */
+struct json_frame {
+	const void *node;
+	size_t i;
+	enum json_value_type type;
+	const char *base;
+	struct json_cache *cache;
+	const char *start;
+};
+
+/*
+ * Caller owned state of a single generate_json_r() call. Every call resets it
+ * - except for 'user', which is left for the flush callback, and the output
+ * options. Zero the struct once to get the default output. Use one context
+ * per thread.
+ */
+struct mtojson_ctx {
+	// Output options: leave out the spaces after ',' and ':', or start a line
+	// indented by indent spaces per level for every member and element
+	_Bool compact;
+	unsigned indent;
+
+	size_t rem_len;
+	int nested_object_depth;
+	enum json_error error;
+	int sink;
+	json_flush_fn flush;
+	char *buf;
+	size_t buf_len;
+	size_t total;
+	void *user;
+	char tmp[32];
+
+	// json_gen_next() cursor
+	struct json_frame stack[MAX_NESTING_DEPTH];
+	int depth;
+	int state;
+	const void *val;
+	enum json_value_type type;
+	const char *pend;
+	size_t pend_len;
+	size_t str_len;
+	size_t pad;
+	_Bool nl;
+
+	struct json_template *tpl;
+
+	// The member or element of a struct being generated
+	struct json_kv member;
+	struct json_struct elem;
+
+	// generate_json_iov() segments
+	struct json_iovec *iov;
+	size_t iov_cnt;
+	size_t iov_max;
+	size_t threshold;
+	char *seg;
+
+#ifdef MTOJSON_STATS
+	struct json_stats stats;
+	json_hook_fn hook; // Kept across calls like the output options
+#endif
+
+#ifdef MTOJSON_THREADS
+	// generate_json_parallel() workers, or whether this is one of them
+	struct json_worker *workers;
+	unsigned nworkers;
+	_Bool worker;
+#endif
+};
+
+#ifdef MTOJSON_THREADS
+// Caller owned state of one thread of generate_json_parallel()
+struct json_worker {
+	struct mtojson_ctx ctx;
+	struct json_array part;
+	size_t first;
+	size_t len;
+	pthread_t thread;
+	_Bool started;
+};
+#endif
+
 size_t generate_json(char *out, const struct json_kv *kv, size_t len);
+size_t generate_json_r(struct mtojson_ctx *ctx, char *out,
+		const struct json_kv *kv, size_t len);
+size_t generate_json_stream(struct mtojson_ctx *ctx, const struct json_kv *kv,
+		char *buf, size_t len, json_flush_fn flush);
+
+/*
+ * Generate kv as iovcnt segments at most: everything is written to scratch,
+ * but pieces of strings and values of at least threshold bytes are referenced
+ * where they are. Returns the number of segments, which are valid as long as
+ * kv and scratch are, or 0 on error. The JSON is not NUL terminated.
+ */
+size_t generate_json_iov(struct mtojson_ctx *ctx, const struct json_kv *kv,
+		char *scratch, size_t len, struct json_iovec *iov, size_t iovcnt,
+		size_t threshold);
+
+#ifdef MTOJSON_THREADS
+/*
+ * Like generate_json_r(), but arrays of at least MTOJSON_PARALLEL_MIN elements
+ * are split into n chunks, which are measured and then generated into place
+ * by n threads. One of them is the calling thread. Pretty printed output and
+ * an n of 1 are generated by the calling thread alone. With MTOJSON_STATS the
+ * statistics of all chunks add up in ctx->stats, but ctx->hook is called by
+ * every thread for its chunk, with the context of its worker.
+ */
+size_t generate_json_parallel(struct mtojson_ctx *ctx, char *out,
+		const struct json_kv *kv, size_t len, struct json_worker *workers,
+		unsigned n);
+#endif
+
+enum json_batch_mode {
+	m_json_ndjson,
+	m_json_array,
+};
+
+/*
+ * Generate as many of the n records as fit into out, either each followed by
+ * a newline or as one array of them. Returns the number of whole records
+ * generated and the NUL terminated JSON is their result. Newline delimited
+ * records are always on one line, ctx->indent is ignored for them.
+ */
+size_t generate_json_batch(char *out, const struct json_kv *const records[],
+		size_t n, size_t len, enum json_batch_mode mode);
+size_t generate_json_batch_r(struct mtojson_ctx *ctx, char *out,
+		const struct json_kv *const records[], size_t n, size_t len,
+		enum json_batch_mode mode);
+
+/*
+ * Return the exact buffer size generate_json() needs for kv, including the
+ * terminating NUL, or 0 if kv can not be generated.
+ */
+size_t json_measure(const struct json_kv *kv);
+size_t json_measure_r(struct mtojson_ctx *ctx, const struct json_kv *kv);
+
+/*
+ * Generate kv piecewise: after json_gen_begin() every call to json_gen_next()
+ * fills buf with the next len bytes of JSON and returns how many were written.
+ * It returns less than len only at the end of the JSON, 0 once it is done or
+ * on error. The JSON is not NUL terminated. kv must stay unchanged meanwhile.
+ */
+void json_gen_begin(struct mtojson_ctx *ctx, const struct json_kv *kv);
+size_t json_gen_next(struct mtojson_ctx *ctx, char *buf, size_t len);
+
+/*
+ * For objects with always the same keys: json_template_compile() generates
+ * everything but the values of kv once and returns the skeleton length, or 0
+ * on error. Arrays are values, too. json_template_render() then writes the
+ * JSON of the current values to out just like generate_json_r(). The values
+ * are read through the pointers of kv, which need to stay valid. Render with
+ * the output options the template was compiled with.
+ */
+size_t json_template_compile(struct mtojson_ctx *ctx, struct json_template *tpl,
+		const struct json_kv *kv);
+size_t json_template_render(struct mtojson_ctx *ctx,
+		const struct json_template *tpl, char *out, size_t len);
+
+// Where json_template_render_fixed() put a value
+struct json_patch_slot {
+	size_t offset;
+	size_t width;
+	enum json_value_type type;
+};
+
+/*
+ * Like json_template_render(), but numbers and booleans are padded with
+ * spaces to the longest JSON of their type. ps gets the position of every
+ * slot of tpl, json_patch() then rewrites a single value of out in place.
+ * It returns -1 for strings and arrays, which have no fixed width.
+ */
+size_t json_template_render_fixed(struct mtojson_ctx *ctx,
+		const struct json_template *tpl, char *out, size_t len,
+		struct json_patch_slot *ps);
+int json_patch(char *buf, const struct json_patch_slot *ps, const void *value);
+
+/*
+ * Builds json_kv trees in a caller supplied arena, without any heap
+ * allocation. Nodes and values are allocated one after the other and
+ * json_builder_reset() frees all of them at once, e.g. per message.
+ */
+struct json_builder {
+	char *arena;
+	size_t size;
+	size_t used;
+};
+
+// An object of at most max members, kv is always NULL terminated
+struct json_obj {
+	struct json_kv *kv;
+	size_t count;
+	size_t max;
+};
+
+void json_builder_init(struct json_builder *b, void *arena, size_t size);
+void json_builder_reset(struct json_builder *b);
+// Suitably aligned memory for anything else, NULL if the arena is full
+void *json_builder_alloc(struct json_builder *b, size_t size);
+struct json_obj *json_obj_new(struct json_builder *b, size_t max);
+
+/*
+ * Append a member to obj, returning 0 or -1 if obj or the arena is full.
+ * json_obj_add() references value, like a json_kv does. The other functions
+ * copy the value to the arena, strings too. Keys are always referenced.
+ */
+int json_obj_add(struct json_obj *obj, const char *key,
+		enum json_value_type type, const void *value);
+int json_obj_add_int(struct json_builder *b, struct json_obj *obj,
+		const char *key, int64_t value);
+int json_obj_add_uint(struct json_builder *b, struct json_obj *obj,
+		const char *key, uint64_t value);
+int json_obj_add_bool(struct json_builder *b, struct json_obj *obj,
+		const char *key, _Bool value);
+int json_obj_add_double(struct json_builder *b, struct json_obj *obj,
+		const char *key, double value);
+int json_obj_add_string(struct json_builder *b, struct json_obj *obj,
+		const char *key, const char *value);
+int json_obj_add_obj(struct json_obj *obj, const char *key,
+		const struct json_obj *child);
+// The count elements of type at values are referenced, not copied
+int json_obj_add_array(struct json_builder *b, struct json_obj *obj,
+		const char *key, const void *values, size_t count,
+		enum json_value_type type);
+
+/*
+ * Copy the tree of kv to the arena of b, in the order generate_json() reads
+ * it, and return the copy or NULL on error, ctx->error tells why. Numbers,
+ * booleans and the headers of strings, arrays and binary data are copied,
+ * strings, arrays of them and arrays of numbers are still referenced.
+ */
+const struct json_kv *json_flatten(struct mtojson_ctx *ctx,
+		struct json_builder *b, const struct json_kv *kv);
 #endif
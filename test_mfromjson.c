@@ -0,0 +1,503 @@
+/*
+ * Tests for mfromjson.h
+ *
+ * If tests fail exit status is the count of failed tests. All succeeding tests
+ * will be run and the number of the failed tests will be printed to stderr.
+ */
+
+/*
+ * SPDX-License-Identifier: BSD-2-Clause
+ * This file is Copyright (c) 2020 by Rene Kita
+ */
+
+#include "mfromjson.h"
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Bool single_test = 0;
+int verbose = 0;
+
+static void
+tell_single_test(char* test)
+{
+	if (single_test || verbose){
+		printf("Running test: %-30s ", test);
+		if (!verbose)
+			printf("%s", "\n");
+	}
+}
+
+// Report a failed check, returns 1
+static int
+report(char *test, const char *what, const struct mfromjson_ctx *ctx)
+{
+	fprintf(stderr, "\nFAILED: %s: %s (error %d at %zu)\n", test, what,
+			ctx->error, ctx->pos);
+	return 1;
+}
+
+static int
+test_parse_object(void)
+{
+	char *test = "test_parse_object";
+	char in[] = " {\"i\": -42, \"u\": 4000000000, \"skip\": {\"a\": [1, {\"b\": null}]},"
+	            "\n\t\"b\": true, \"d\": -1.5e3, \"f\": 0.25, \"i8\": -128,"
+	            " \"u64\": 18446744073709551615, \"n\": null, \"x\": [] } {}";
+	tell_single_test(test);
+
+	int i = 0;
+	unsigned u = 0;
+	bool b = false;
+	double d = 0;
+	float f = 0;
+	int8_t i8 = 0;
+	uint64_t u64 = 0;
+	const struct json_kv jkv[] = {
+		{ .key = "i", .value = &i, .type = t_to_integer, },
+		{ .key = "u", .value = &u, .type = t_to_uinteger, },
+		{ .key = "b", .value = &b, .type = t_to_boolean, },
+		{ .key = "d", .value = &d, .type = t_to_double, },
+		{ .key = "f", .value = &f, .type = t_to_float, },
+		{ JSON_KEY("i8"), .value = &i8, .type = t_to_int8, },
+		{ .key = "u64", .value = &u64, .type = t_to_uint64, },
+		{ .key = "n", .type = t_to_null, },
+		{ NULL },
+	};
+
+	struct mfromjson_ctx ctx;
+	size_t n = json_parse(&ctx, in, strlen(in), jkv);
+	if (!n || in[n] != ' ')
+		return report(test, "offset", &ctx);
+	if (i != -42 || u != 4000000000U || !b || d > -1499.9 || d < -1500.1
+	    || f > 0.26f || f < 0.24f || i8 != -128 || u64 != UINT64_MAX)
+		return report(test, "values", &ctx);
+
+	// The next object follows right after
+	return !json_parse(&ctx, in + n, strlen(in + n), jkv);
+}
+
+static int
+test_parse_string(void)
+{
+	char *test = "test_parse_string";
+	char in[] = "{\"s\": \"a\\\"b\\\\c\\/\\n\\t\\u00e4\\u20ac\\ud83d\\ude00\\ud800!\","
+	            " \"plain\": \"xyz\"}";
+	tell_single_test(test);
+
+	struct json_str s = {0}, plain = {0};
+	const struct json_kv jkv[] = {
+		{ .key = "s", .value = &s, .type = t_to_strn, },
+		{ .key = "plain", .value = &plain, .type = t_to_strn, },
+		{ NULL },
+	};
+	struct mfromjson_ctx ctx;
+	if (!json_parse(&ctx, in, strlen(in), jkv))
+		return report(test, "parse", &ctx);
+
+	const char *expected = "a\"b\\c/\n\t\xc3\xa4\xe2\x82\xac\xf0\x9f\x98\x80\xef\xbf\xbd!";
+	if (s.len != strlen(expected) || memcmp(s.p, expected, s.len))
+		return report(test, "unescape", &ctx);
+	if (plain.len != 3 || memcmp(plain.p, "xyz", 3))
+		return report(test, "plain", &ctx);
+
+	// A char array of unknown size can't be filled
+	char in2[] = "{\"s\": \"x\"}";
+	char buf[8];
+	const struct json_kv jkv2[] = {
+		{ .key = "s", .value = buf, .type = t_to_string, },
+		{ NULL },
+	};
+	if (json_parse(&ctx, in2, strlen(in2), jkv2) || ctx.error != e_parse_type)
+		return report(test, "char array", &ctx);
+
+	// Only counted strings may hold a NUL
+	char in3[] = "{\"s\": \"a\\u0000b\"}";
+	if (!json_parse(&ctx, in3, strlen(in3), jkv) || s.len != 3
+	    || memcmp(s.p, "a\0b", 3))
+		return report(test, "counted NUL", &ctx);
+	char in4[] = "{\"n\": [\"a\\u0000b\"]}";
+	const char *names[1];
+	struct json_array jar_names = { .value = names, .type = t_to_string, .max = 1 };
+	const struct json_kv jkv4[] = {
+		{ .key = "n", .value = &jar_names, .type = t_to_array, },
+		{ NULL },
+	};
+	return json_parse(&ctx, in4, strlen(in4), jkv4) || ctx.error != e_parse_range
+		|| ctx.pos != 7;
+}
+
+static int
+test_parse_array(void)
+{
+	char *test = "test_parse_array";
+	char in[] = "{\"ints\": [1, -2, 3], \"names\": [\"a\", \"b\\tc\"],"
+	            " \"objs\": [{\"id\": 1}, {\"id\": 2}], \"nested\": [[5, 6], []]}";
+	tell_single_test(test);
+
+	int ints[4];
+	const char *names[2];
+	int id[2];
+	int16_t n1[2], n2[2];
+	struct json_array jar_ints = { .value = ints, .type = t_to_integer, .max = 4 };
+	struct json_array jar_names = { .value = names, .type = t_to_string, .max = 2 };
+	const struct json_kv obj0[] = {
+		{ .key = "id", .value = &id[0], .type = t_to_integer, },
+		{ NULL },
+	};
+	const struct json_kv obj1[] = {
+		{ .key = "id", .value = &id[1], .type = t_to_integer, },
+		{ NULL },
+	};
+	const struct json_kv *objs[] = { obj0, obj1 };
+	struct json_array jar_objs = { .value = objs, .type = t_to_object, .max = 2 };
+	struct json_array jar_n1 = { .value = n1, .type = t_to_int16, .max = 2 };
+	struct json_array jar_n2 = { .value = n2, .type = t_to_int16, .max = 2 };
+	const struct json_array *nested[] = { &jar_n1, &jar_n2 };
+	struct json_array jar_nested = { .value = nested, .type = t_to_array, .max = 2 };
+	const struct json_kv jkv[] = {
+		{ .key = "ints", .value = &jar_ints, .type = t_to_array, },
+		{ .key = "names", .value = &jar_names, .type = t_to_array, },
+		{ .key = "objs", .value = &jar_objs, .type = t_to_array, },
+		{ .key = "nested", .value = &jar_nested, .type = t_to_array, },
+		{ NULL },
+	};
+
+	struct mfromjson_ctx ctx;
+	if (!json_parse(&ctx, in, strlen(in), jkv))
+		return report(test, "parse", &ctx);
+	if (jar_ints.count != 3 || ints[0] != 1 || ints[1] != -2 || ints[2] != 3)
+		return report(test, "ints", &ctx);
+	if (jar_names.count != 2 || strcmp(names[0], "a") || strcmp(names[1], "b\tc"))
+		return report(test, "names", &ctx);
+	if (jar_objs.count != 2 || id[0] != 1 || id[1] != 2)
+		return report(test, "objects", &ctx);
+	if (jar_nested.count != 2 || jar_n1.count != 2 || n1[1] != 6 || jar_n2.count)
+		return report(test, "nested", &ctx);
+
+	// More elements than there is room for
+	char in2[] = "{\"ints\": [1, 2, 3, 4, 5]}";
+	return json_parse(&ctx, in2, strlen(in2), jkv) || ctx.error != e_parse_space;
+}
+
+struct test_pos {
+	int16_t x;
+	int16_t y;
+};
+
+struct test_rec {
+	uint32_t id;
+	bool ok;
+	char name[8];
+	struct test_pos pos;
+};
+
+static const struct json_field pos_fields[] = {
+	{ JSON_FIELD(struct test_pos, x, t_to_int16), },
+	{ JSON_FIELD(struct test_pos, y, t_to_int16), },
+	{ NULL },
+};
+
+static const struct json_field rec_fields[] = {
+	{ JSON_FIELD(struct test_rec, id, t_to_uint32), },
+	{ JSON_FIELD(struct test_rec, ok, t_to_boolean), },
+	{ JSON_FIELD(struct test_rec, name, t_to_string), },
+	{ JSON_FIELD(struct test_rec, pos, t_to_struct), .fields = pos_fields, },
+	{ NULL },
+};
+
+static int
+test_parse_struct(void)
+{
+	char *test = "test_parse_struct";
+	char in[] = "{\"id\": 7, \"name\": \"seven\", \"pos\": {\"y\": -1, \"x\": 2}, \"ok\": true}";
+	tell_single_test(test);
+
+	struct test_rec rec = {0};
+	const struct json_struct js = { .fields = rec_fields, .base = &rec };
+	struct mfromjson_ctx ctx;
+	if (!json_parse_struct(&ctx, in, strlen(in), &js))
+		return report(test, "parse", &ctx);
+	if (rec.id != 7 || !rec.ok || strcmp(rec.name, "seven") || rec.pos.x != 2
+	    || rec.pos.y != -1)
+		return report(test, "values", &ctx);
+
+	// Arrays of structs, names must fit their char array
+	char in2[] = "{\"recs\": [{\"id\": 1, \"name\": \"a\"}, {\"id\": 2, \"name\": \"b\"}]}";
+	struct test_rec recs[2] = {{0}};
+	const struct json_struct js_recs = { .fields = rec_fields, .base = recs,
+		.stride = sizeof(recs[0]) };
+	struct json_array jar = { .value = &js_recs, .type = t_to_struct, .max = 2 };
+	const struct json_kv jkv[] = {
+		{ .key = "recs", .value = &jar, .type = t_to_array, },
+		{ NULL },
+	};
+	if (!json_parse(&ctx, in2, strlen(in2), jkv))
+		return report(test, "array", &ctx);
+	if (jar.count != 2 || recs[1].id != 2 || strcmp(recs[1].name, "b"))
+		return report(test, "array values", &ctx);
+
+	char in3[] = "{\"name\": \"too long!\"}";
+	if (json_parse_struct(&ctx, in3, strlen(in3), &js) || ctx.error != e_parse_range)
+		return report(test, "long name", &ctx);
+
+	// A char array can't hold a NUL either
+	char in4[] = "{\"name\": \"\\u0000\"}";
+	return json_parse_struct(&ctx, in4, strlen(in4), &js) || ctx.error != e_parse_range;
+}
+
+static int
+test_parse_optional(void)
+{
+	char *test = "test_parse_optional";
+	char in[] = "{\"a\": 1, \"c\": null}";
+	tell_single_test(test);
+
+	int a = 0, b = 0, c = 5;
+	bool has_a = false, has_b = true, has_c = true;
+	const struct json_kv jkv[] = {
+		{ .key = "a", .value = &a, .type = t_to_integer, .present = &has_a, },
+		{ .key = "b", .value = &b, .type = t_to_integer, .present = &has_b, },
+		{ .key = "c", .value = &c, .type = t_to_integer, .present = &has_c, },
+		{ NULL },
+	};
+	struct mfromjson_ctx ctx;
+	if (!json_parse(&ctx, in, strlen(in), jkv))
+		return report(test, "parse", &ctx);
+	if (!has_a || a != 1 || has_b || has_c || c != 5)
+		return report(test, "present", &ctx);
+
+	// null for a member that can't be absent
+	char in2[] = "{\"x\": null}";
+	const struct json_kv jkv2[] = {
+		{ .key = "x", .value = &a, .type = t_to_integer, },
+		{ NULL },
+	};
+	return json_parse(&ctx, in2, strlen(in2), jkv2) || ctx.error != e_parse_type;
+}
+
+static int
+test_parse_raw(void)
+{
+	char *test = "test_parse_raw";
+	char in[] = "{\"cfg\": {\"a\": [1, \"}\"], \"b\": {}}, \"v\": -1.5, \"s\": \"q\\\"\"}";
+	tell_single_test(test);
+
+	struct json_str cfg = {0}, v = {0}, s = {0};
+	const struct json_kv jkv[] = {
+		{ .key = "cfg", .value = &cfg, .type = t_to_valuen, },
+		{ .key = "v", .value = &v, .type = t_to_valuen, },
+		{ .key = "s", .value = &s, .type = t_to_valuen, },
+		{ NULL },
+	};
+	struct mfromjson_ctx ctx;
+	if (!json_parse(&ctx, in, strlen(in), jkv))
+		return report(test, "parse", &ctx);
+	if (cfg.len != 24 || memcmp(cfg.p, "{\"a\": [1, \"}\"], \"b\": {}}", 24))
+		return report(test, "object", &ctx);
+	if (v.len != 4 || memcmp(v.p, "-1.5", 4) || s.len != 5 || memcmp(s.p, "\"q\\\"\"", 5))
+		return report(test, "scalars", &ctx);
+	return 0;
+}
+
+static int
+test_parse_errors(void)
+{
+	char *test = "test_parse_errors";
+	tell_single_test(test);
+
+	int i = 0;
+	int8_t i8 = 0;
+	unsigned u = 0;
+	const struct json_kv jkv[] = {
+		{ .key = "i", .value = &i, .type = t_to_integer, },
+		{ .key = "i8", .value = &i8, .type = t_to_int8, },
+		{ .key = "u", .value = &u, .type = t_to_uinteger, },
+		{ NULL },
+	};
+	static const struct {
+		const char *json;
+		enum json_parse_error error;
+		size_t pos;
+	} cases[] = {
+		{ "", e_parse_syntax, 0 },
+		{ "[1]", e_parse_syntax, 0 },
+		{ "{\"i\": 1", e_parse_syntax, 7 },
+		{ "{\"i\": 1,}", e_parse_syntax, 8 },
+		{ "{\"i\" 1}", e_parse_syntax, 5 },
+		{ "{\"i\": 01}", e_parse_syntax, 7 },
+		{ "{\"i\": -}", e_parse_syntax, 7 },
+		{ "{\"i\": 1.}", e_parse_syntax, 8 },
+		{ "{\"x\": \"a\nb\"}", e_parse_syntax, 8 },
+		{ "{\"x\": \"\\x\"}", e_parse_syntax, 8 },
+		{ "{\"x\": \"\\u12g4\"}", e_parse_syntax, 8 },
+		{ "{\"x\": tru}", e_parse_syntax, 6 },
+		{ "{\"x\": [1 2]}", e_parse_syntax, 9 },
+		{ "{\"x\": [}", e_parse_syntax, 7 },
+		{ "{\"i8\": 128}", e_parse_range, 10 },
+		{ "{\"i\": 99999999999999999999}", e_parse_range, 26 },
+		{ "{\"u\": -1}", e_parse_range, 8 },
+		{ "{\"i\": 1.5}", e_parse_type, 6 },
+		{ "{\"i\": \"1\"}", e_parse_type, 6 },
+		{ "{\"i\": {}}", e_parse_type, 6 },
+		{ "{\"x\": [[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]}", e_parse_depth, 6 + MAX_NESTING_DEPTH - 1 },
+	};
+	char in[64];
+	struct mfromjson_ctx ctx;
+
+	for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++){
+		size_t len = strlen(cases[k].json);
+		memcpy(in, cases[k].json, len);
+		if (json_parse(&ctx, in, len, jkv) || ctx.error != cases[k].error
+		    || ctx.pos != cases[k].pos){
+			fprintf(stderr, "%s\n", cases[k].json);
+			return report(test, "error", &ctx);
+		}
+	}
+	return 0;
+}
+
+// Generate, parse into other values with the same descriptors, generate again
+static int
+test_parse_round_trip(void)
+{
+	char *test = "test_parse_round_trip";
+	tell_single_test(test);
+
+	int ints[3] = {1, -2, 3};
+	struct json_str name = { "n\"ame\n", 6 };
+	double d = 0.125;
+	bool b = true;
+	struct test_rec rec = { .id = 9, .ok = true, .name = "rec", .pos = { -5, 6 } };
+	struct json_array jar = { .value = ints, .count = 3, .type = t_to_integer, .max = 3 };
+	// Without pos, which would be nested too deep for MAX_NESTED_OBJECT_DEPTH=1
+	const struct json_field fields[] = {
+		{ JSON_FIELD(struct test_rec, id, t_to_uint32), },
+		{ JSON_FIELD(struct test_rec, ok, t_to_boolean), },
+		{ JSON_FIELD(struct test_rec, name, t_to_string), },
+		{ NULL },
+	};
+	struct json_struct js = { .fields = fields, .base = &rec };
+	struct json_kv jkv[] = {
+		{ .key = "ints", .value = &jar, .type = t_to_array, },
+		{ .key = "name", .value = &name, .type = t_to_strn, },
+		{ .key = "d", .value = &d, .type = t_to_double, },
+		{ .key = "b", .value = &b, .type = t_to_boolean, },
+		{ .key = "rec", .value = &js, .type = t_to_struct, },
+		{ NULL },
+	};
+
+	char first[160], second[160];
+	size_t len = generate_json(first, jkv, sizeof(first));
+	if (!len){
+		fprintf(stderr, "\nFAILED: %s: generate\n", test);
+		return 1;
+	}
+
+	// Point the same tables at zeroed values and read them back
+	char in[160];
+	memcpy(in, first, len + 1);
+	memset(ints, 0, sizeof(ints));
+	name.p = NULL;
+	d = 0;
+	b = false;
+	memset(&rec, 0, sizeof(rec));
+	jar.count = 0;
+
+	struct mfromjson_ctx ctx;
+	if (json_parse(&ctx, in, len, jkv) != len)
+		return report(test, "parse", &ctx);
+	if (generate_json(second, jkv, sizeof(second)) != len || strcmp(first, second)){
+		fprintf(stderr, "\nFAILED: %s\n%s\n%s\n", test, first, second);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+exec_test(int i)
+{
+	switch (i){
+	case 1:
+		return test_parse_object();
+		break;
+	case 2:
+		return test_parse_string();
+		break;
+	case 3:
+		return test_parse_array();
+		break;
+	case 4:
+		return test_parse_struct();
+		break;
+	case 5:
+		return test_parse_optional();
+		break;
+	case 6:
+		return test_parse_raw();
+		break;
+	case 7:
+		return test_parse_errors();
+		break;
+	case 8:
+		return test_parse_round_trip();
+		break;
+	default:
+		fputs("No such test!\n", stderr);
+		return 1;
+	}
+	return 1;
+}
+#define MAXTEST 8
+
+int
+main(int argc, char *argv[])
+{
+	int failed_tests[MAXTEST];
+	int failed = 0;
+	int opt;
+	int test = 0;
+	int rv = 0;
+
+	while ((opt = getopt(argc, argv, "hn:v")) != -1){
+		switch (opt){
+		case 'n':
+			single_test = 1;
+			test = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		default:
+			fputs("usage: test_mfromjson [-n number]\n", stderr);
+			return 1;
+		}
+	}
+
+	if (test){
+		rv = exec_test(test);
+	} else {
+		for (int i = 1; i <= MAXTEST; i++){
+			rv = exec_test(i);
+			if (verbose)
+				printf("%d: %d\n", i, rv);
+			if (rv)
+				failed_tests[failed++] = i;
+		}
+	}
+
+	if (verbose)
+		printf("%s", "\n");
+
+	if (failed){
+		fprintf(stderr, "\n%s ", "Failed tests:");
+		for (int i = 0; i < failed; i++)
+			fprintf(stderr, "%d ", failed_tests[i]);
+		fprintf(stderr, "%s", "\n");
+	}
+	return failed;
+}
@@ -10,6 +10,12 @@
  * If generate_json returns the wrong string length, running tests will be
  * aborted immediately with an exit status 123.
  *
+ * If json_measure returns a size different from the buffer needed, running
+ * tests will be aborted immediately with an exit status 122.
+ *
+ * If json_gen_next generates something different than generate_json, running
+ * tests will be aborted immediately with an exit status 121.
+ *
  * If tests fail exit status is the count of failed tests. All succeeding tests
  * will be run and the number of the failed tests will be printed to stderr.
  *
@@ -24,12 +30,18 @@
 
 #include "mtojson.h"
 
+#include <float.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(MTOJSON_STATS) && defined(MTOJSON_THREADS)
+#include <pthread.h>
+#endif
 #include <unistd.h>
 
 _Bool single_test = 0;
@@ -40,6 +52,23 @@ const char *rp;
 
 static void tell_single_test();
 
+static int
+gen_pieces(char *result, const struct json_kv *jkv, size_t len, size_t piece)
+{
+	struct mtojson_ctx ctx = {0};
+	size_t n, l = 0;
+
+	json_gen_begin(&ctx, jkv);
+	do {
+		if (l + piece > len)
+			return 1;
+		n = json_gen_next(&ctx, result + l, piece);
+		l += n;
+	} while (n == piece);
+	result[l] = '\0';
+	return ctx.error != e_json_ok;
+}
+
 static void
 run_test(char *test, char *result, const struct json_kv *jkv, size_t len, _Bool fails)
 {
@@ -49,6 +78,12 @@ run_test(char *test, char *result, const struct json_kv *jkv, size_t len, _Bool
 		return;
 	}
 
+	if (json_measure(jkv) != len) {
+		if (verbose)
+			printf("%s\n", "Measured length mismatch");
+		exit(122);
+	}
+
 	int err = 0;
 	if (len >= 10 && generate_json(result, jkv, len - 10))
 		err++;
@@ -76,6 +111,16 @@ run_test(char *test, char *result, const struct json_kv *jkv, size_t len, _Bool
 			printf("%s\n", "String length mismatch");
 		exit(123);
 	}
+
+	char pieces[len + 8];
+	for (size_t piece = 1; piece < 8; piece += 3){
+		if (gen_pieces(pieces, jkv, len + 7, piece)
+		    || strcmp(pieces, result)) {
+			if (verbose)
+				printf("%s\n", "Resumed generation mismatch");
+			exit(121);
+		}
+	}
 }
 
 static int
@@ -634,77 +679,1685 @@ test_json_uint_max(void)
 	run_test(test, result, jkv, len, 0);
 	return check_result(test, expected, result);
 }
+
 static int
-exec_test(int i)
+test_json_reentrant(void)
 {
-	switch (i){
-	case 1:
-		return test_json_integer();
-		break;
-	case 2:
-		return test_json_integer_two();
-		break;
-	case 3:
-		return test_json_string();
-		break;
-	case 4:
-		return test_json_boolean();
-		break;
-	case 5:
-		return test_json_valuetype();
-		break;
-	case 6:
-		return test_json_array_integer();
-		break;
-	case 7:
-		return test_json_array_boolean();
-		break;
-	case 8:
-		return test_json_array_string();
-		break;
-	case 9:
-		return test_json_array_array();
-		break;
-	case 10:
-		return test_json_array_empty();
-		break;
-	case 11:
-		return test_json_array_empty_one();
-		break;
-	case 12:
-		return test_json_object();
-		break;
-	case 13:
-		return test_json_array_object();
-		break;
-	case 14:
-		return test_json_object_empty();
-		break;
-	case 15:
-#ifdef MAX_NESTED_OBJECT_DEPTH
-		if (MAX_NESTED_OBJECT_DEPTH < 2)
-			return test_json_object_object(1);
+	char *expected = "{\"key\": 1}";
+	char *test = "test_json_reentrant";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	char short_result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	const int n = 1;
+	const struct json_kv jkv[] = {
+		{ .key = "key", .value = &n, .type = t_to_integer, },
+		{ NULL },
+	};
+	tell_single_test(test);
+
+	struct mtojson_ctx a = {0}, b = {0};
+	if (generate_json_r(&b, short_result, jkv, len - 1) != 0
+	    || b.error != e_json_no_space)
+		return 1;
+	if (generate_json_r(&a, result, jkv, len) != len - 1
+	    || a.error != e_json_ok)
+		return 1;
+	if (b.error != e_json_no_space)
+		return 1;
+	return check_result(test, expected, result);
+}
+
+struct stream_sink {
+	char *result;
+	size_t len;
+	size_t max_len;
+	size_t flushes;
+};
+
+static int
+stream_flush(struct mtojson_ctx *ctx, const char *buf, size_t len)
+{
+	struct stream_sink *sink = ctx->user;
+
+	if (sink->len + len > sink->max_len)
+		return 1;
+	memcpy(sink->result + sink->len, buf, len);
+	sink->len += len;
+	sink->flushes++;
+	return 0;
+}
+
+static int
+test_json_stream(void)
+{
+	char *expected = "{\"id\": 4294967295, \"name\": \"a rather long string\", "
+	                  "\"values\": [1, 22, 333], \"inner\": {\"ok\": false}}";
+	char *test = "test_json_stream";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	const unsigned id = UINT_MAX;
+	const _Bool ok = false;
+	const int values[] = {1, 22, 333};
+	const struct json_array jar = {
+		.value = values, .count = 3, .type = t_to_integer };
+	const struct json_kv inner[] = {
+		{ .key = "ok", .value = &ok, .type = t_to_boolean, },
+		{ NULL },
+	};
+	const struct json_kv jkv[] = {
+		{ .key = "id", .value = &id, .type = t_to_uinteger, },
+		{ .key = "name", .value = "a rather long string", .type = t_to_string, },
+		{ .key = "values", .value = &jar, .type = t_to_array, },
+		{ .key = "inner", .value = &inner, .type = t_to_object, },
+		{ NULL },
+	};
+	tell_single_test(test);
+
+	struct mtojson_ctx ctx = {0};
+	struct stream_sink sink;
+	char buf[8];
+	ctx.user = &sink;
+	for (size_t n = 1; n <= sizeof(buf); n++){
+		memset(result, '\0', len);
+		sink = (struct stream_sink){ .result = result, .max_len = len };
+		if (generate_json_stream(&ctx, jkv, buf, n, stream_flush) != len - 1
+		    || sink.len != len - 1)
+			return 1;
+		if (check_result(test, expected, result))
+			return 1;
+	}
+
+	if (generate_json_stream(&ctx, jkv, buf, 0, stream_flush)
+	    || ctx.error != e_json_no_space)
+		return 1;
+
+	// A failing sink aborts generation
+	sink = (struct stream_sink){ .result = result, .max_len = len / 2 };
+	if (generate_json_stream(&ctx, jkv, buf, sizeof(buf), stream_flush)
+	    || ctx.error != e_json_flush)
+		return 1;
+
+	memset(result, '\0', len);
+	sink = (struct stream_sink){ .result = result, .max_len = len };
+	generate_json_stream(&ctx, jkv, buf, sizeof(buf), stream_flush);
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_resumable(void)
+{
+#if MAX_NESTING_DEPTH >= 5
+	char *expected = "{\"name\": \"a rather long string\", "
+	                  "\"keys\": [{\"id\": -2147483647}, {}, {\"v\": [[true], []]}]}";
+#else
+	char *expected = "{\"name\": \"a rather long string\", "
+	                  "\"keys\": [{\"id\": -2147483647}, {}, {\"v\": [true]}]}";
 #endif
-		return test_json_object_object(0);
-		break;
-	case 16:
-#ifdef MAX_NESTED_OBJECT_DEPTH
-		if (MAX_NESTED_OBJECT_DEPTH < 3)
-			return test_json_object_nested_empty(1);
+	char *test = "test_json_resumable";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	const int id = -2147483647;
+	const _Bool t = true;
+	const struct json_array inner_arr[] = {
+		{ .value = &t, .count = 1, .type = t_to_boolean },
+		{ .value = NULL, .count = 0, .type = t_to_boolean },
+	};
+#if MAX_NESTING_DEPTH >= 5
+	const struct json_array *inner_ptr[] = { &inner_arr[0], &inner_arr[1] };
+	const struct json_array inner = {
+		.value = inner_ptr, .count = 2, .type = t_to_array };
+#else
+	// One level less for smaller stacks
+	const struct json_array inner = inner_arr[0];
 #endif
-		return test_json_object_nested_empty(0);
-		break;
-	case 17:
-		return test_json_uinteger();
-		break;
-	case 18:
-		return test_json_int_max();
-		break;
-	case 19:
-		return test_json_int_min();
-		break;
-	case 20:
-		return test_json_uint_max();
+	const struct json_kv objs[][2] = {
+		{ { .key = "id", .value = &id, .type = t_to_integer }, { NULL } },
+		{ { NULL } },
+		{ { .key = "v", .value = &inner, .type = t_to_array }, { NULL } },
+	};
+	const struct json_kv *objs_ptr[] = { objs[0], objs[1], objs[2] };
+	const struct json_array keys = {
+		.value = objs_ptr, .count = 3, .type = t_to_object };
+	const struct json_kv jkv[] = {
+		{ .key = "name", .value = "a rather long string", .type = t_to_string, },
+		{ .key = "keys", .value = &keys, .type = t_to_array, },
+		{ NULL },
+	};
+	tell_single_test(test);
+
+	char pieces[2 * len];
+	for (size_t piece = 1; piece <= len; piece++){
+		if (gen_pieces(pieces, jkv, sizeof(pieces) - 1, piece)
+		    || check_result(test, expected, pieces))
+			return 1;
+	}
+
+	// Once done, it stays done
+	struct mtojson_ctx ctx = {0};
+	json_gen_begin(&ctx, jkv);
+	if (json_gen_next(&ctx, result, len) != len - 1
+	    || json_gen_next(&ctx, result, len) != 0)
+		return 1;
+	result[len - 1] = '\0';
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_nesting_depth(void)
+{
+	char expected[2 * MAX_NESTING_DEPTH + 16];
+	char *test = "test_json_nesting_depth";
+	const size_t arrays = MAX_NESTING_DEPTH - 1; // The outermost object counts
+	strcpy(expected, "{\"a\": ");
+	for (size_t i = 0; i < arrays; i++)
+		strcat(expected, "[");
+	for (size_t i = 0; i < arrays; i++)
+		strcat(expected, "]");
+	strcat(expected, "}");
+
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	struct json_array jar[MAX_NESTING_DEPTH + 1];
+	const struct json_array *jar_ptr[MAX_NESTING_DEPTH + 1];
+	for (size_t i = 0; i <= MAX_NESTING_DEPTH; i++){
+		jar_ptr[i] = &jar[i];
+		jar[i] = (struct json_array){
+			.value = &jar_ptr[i + 1], .count = 1, .type = t_to_array };
+	}
+	jar[arrays - 1].count = 0;
+
+	const struct json_kv jkv[] = {
+		{ .key = "a", .value = &jar[0], .type = t_to_array, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	if (check_result(test, expected, result))
+		return 1;
+
+	// One more array exceeds the limit
+	jar[arrays - 1].count = 1;
+	jar[arrays].count = 0;
+	struct mtojson_ctx ctx = {0};
+	char large[2 * len];
+	if (generate_json_r(&ctx, large, jkv, sizeof(large))
+	    || ctx.error != e_json_max_depth || json_measure(jkv))
+		return 1;
+	return 0;
+}
+
+static int
+test_json_integer_digits(void)
+{
+	char *expected = "{\"int\": [0, 9, 10, -10, 99, 100, -1000, 10000, 12345, "
+	                  "100000000, -1000000000], "
+	                  "\"uint\": [1000000000, 99999, 100, 7]}";
+	char *test = "test_json_integer_digits";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	const int ints[] = {0, 9, 10, -10, 99, 100, -1000, 10000, 12345,
+		100000000, -1000000000};
+	const unsigned uints[] = {1000000000U, 99999U, 100U, 7U};
+	const struct json_array jar_int = {
+		.value = ints, .count = 11, .type = t_to_integer };
+	const struct json_array jar_uint = {
+		.value = uints, .count = 4, .type = t_to_uinteger };
+
+	const struct json_kv jkv[] = {
+		{ .key = "int", .value = &jar_int, .type = t_to_array, },
+		{ .key = "uint", .value = &jar_uint, .type = t_to_array, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_fixed_width(void)
+{
+	char *expected = "{\"i8\": -128, \"u8\": 255, \"i16\": -32768, "
+	                  "\"u16\": [0, 4096, 65535], \"i32\": -2147483648, "
+	                  "\"u32\": 4294967295, "
+	                  "\"i64\": [-9223372036854775808, 9223372036854775807, "
+	                  "-4294967296, 100000000], "
+	                  "\"u64\": [18446744073709551615, 4294967296, "
+	                  "10000000000000000000, 100000000000000001]}";
+	char *test = "test_json_fixed_width";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	const int8_t i8 = INT8_MIN;
+	const uint8_t u8 = UINT8_MAX;
+	const int16_t i16 = INT16_MIN;
+	const uint16_t u16[] = {0, 4096, UINT16_MAX};
+	const int32_t i32 = INT32_MIN;
+	const uint32_t u32 = UINT32_MAX;
+	const int64_t i64[] = {INT64_MIN, INT64_MAX, -4294967296, 100000000};
+	const uint64_t u64[] = {UINT64_MAX, 4294967296U, 10000000000000000000U,
+		100000000000000001U};
+	const struct json_array jar_u16 = {
+		.value = u16, .count = 3, .type = t_to_uint16 };
+	const struct json_array jar_i64 = {
+		.value = i64, .count = 4, .type = t_to_int64 };
+	const struct json_array jar_u64 = {
+		.value = u64, .count = 4, .type = t_to_uint64 };
+
+	const struct json_kv jkv[] = {
+		{ .key = "i8",  .value = &i8,      .type = t_to_int8, },
+		{ .key = "u8",  .value = &u8,      .type = t_to_uint8, },
+		{ .key = "i16", .value = &i16,     .type = t_to_int16, },
+		{ .key = "u16", .value = &jar_u16, .type = t_to_array, },
+		{ .key = "i32", .value = &i32,     .type = t_to_int32, },
+		{ .key = "u32", .value = &u32,     .type = t_to_uint32, },
+		{ .key = "i64", .value = &jar_i64, .type = t_to_array, },
+		{ .key = "u64", .value = &jar_u64, .type = t_to_array, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	return check_result(test, expected, result);
+}
+
+#ifndef JSON_DOUBLE_DECIMALS
+// Every finite double has to read back as itself
+static int
+test_json_double_roundtrip(void)
+{
+	char result[64];
+	uint64_t x = 88172645463325252U;
+	double d;
+	const struct json_kv jkv[] = {
+		{ .key = "d", .value = &d, .type = t_to_double, },
+		{ NULL },
+	};
+
+	for (int i = 0; i < 100000; i++){
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(&d, &x, sizeof(d));
+		if (!isfinite(d))
+			continue;
+		if (!generate_json(result, jkv, sizeof(result))
+		    || strtod(result + 6, NULL) != d){
+			fprintf(stderr, "%s: %s\n", "test_json_double", result);
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+#ifdef JSON_DOUBLE_DECIMALS
+/*
+ * The JSON of v with JSON_DOUBLE_DECIMALS decimals, rounded half away from
+ * zero. It is null if it has more digits than fit into 64 bits.
+ */
+static char*
+fixed_double(char *dst, double v)
+{
+	uint64_t scale = 1;
+	for (int i = 0; i < JSON_DOUBLE_DECIMALS; i++)
+		scale *= 10;
+
+	double a = fabs(v) * (double)scale + 0.5;
+	if (!(a < 18446744073709551616.0))
+		return dst + sprintf(dst, "null");
+
+	uint64_t n = (uint64_t)a;
+	dst += sprintf(dst, "%s%" PRIu64, v < 0 && n ? "-" : "", n / scale);
+	if (JSON_DOUBLE_DECIMALS)
+		dst += sprintf(dst, ".%0*" PRIu64, JSON_DOUBLE_DECIMALS, n % scale);
+	return dst;
+}
+
+// The n elements of v as JSON array
+static char*
+fixed_doubles(char *dst, const double *v, size_t n)
+{
+	*dst++ = '[';
+	for (size_t i = 0; i < n; i++){
+		if (i)
+			dst += sprintf(dst, ", ");
+		dst = fixed_double(dst, v[i]);
+	}
+	return dst + sprintf(dst, "]");
+}
+#endif
+
+static int
+test_json_double(void)
+{
+	const double zero[] = {0.0, -0.0};
+	const double d[] = {0.1, 1.5, -2.25, 1e21, 123456789012345678901.0, 1e-7,
+		1e-6, 5e-324, DBL_MAX, -1.2345e-300};
+	const float f[] = {0.1f, FLT_MAX, 1e-45f, 16777216.0f};
+#ifndef JSON_DOUBLE_DECIMALS
+	char *expected = "{\"zero\": [0, -0], \"d\": [0.1, 1.5, -2.25, 1e21, "
+	                  "123456789012345680000, 1e-7, 0.000001, 5e-324, "
+	                  "1.7976931348623157e308, -1.2345e-300], "
+	                  "\"f\": [0.1, 3.4028235e38, 1e-45, 16777216], "
+	                  "\"nan\": null, \"inf\": [null, null]}";
+#else
+	char expected[1024];
+	const double fd[] = {f[0], f[1], f[2], f[3]};
+	char *p = expected;
+	p += sprintf(p, "{\"zero\": ");
+	p = fixed_doubles(p, zero, 2);
+	p += sprintf(p, ", \"d\": ");
+	p = fixed_doubles(p, d, 10);
+	p += sprintf(p, ", \"f\": ");
+	p = fixed_doubles(p, fd, 4);
+	sprintf(p, ", \"nan\": null, \"inf\": [null, null]}");
+#endif
+	char *test = "test_json_double";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	const double nan = NAN;
+	const double inf[] = {INFINITY, -INFINITY};
+	const struct json_array jar_zero = {
+		.value = zero, .count = 2, .type = t_to_double };
+	const struct json_array jar_d = {
+		.value = d, .count = 10, .type = t_to_double };
+	const struct json_array jar_f = {
+		.value = f, .count = 4, .type = t_to_float };
+	const struct json_array jar_inf = {
+		.value = inf, .count = 2, .type = t_to_double };
+
+	const struct json_kv jkv[] = {
+		{ .key = "zero", .value = &jar_zero, .type = t_to_array, },
+		{ .key = "d",    .value = &jar_d,    .type = t_to_array, },
+		{ .key = "f",    .value = &jar_f,    .type = t_to_array, },
+		{ .key = "nan",  .value = &nan,      .type = t_to_double, },
+		{ .key = "inf",  .value = &jar_inf,  .type = t_to_array, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+#ifndef JSON_DOUBLE_DECIMALS
+	if (test_json_double_roundtrip())
+		return 1;
+#endif
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_counted_string(void)
+{
+	char *expected = "{\"temp\": \"21.5C\", \"raw\": 21.5, "
+	                  "\"names\": [\"ab\", \"\", \"cde\"], \"mode\": [on, off]}";
+	char *test = "test_json_counted_string";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	// Neither keys nor values need to be NUL terminated
+	const char frame[] = "21.5Cabcdeonoff";
+	const struct json_str temp = { frame, 5 };
+	const struct json_str raw = { frame, 4 };
+	const struct json_str names[] = {{ frame + 5, 2 }, { frame, 0 },
+		{ frame + 7, 3 }};
+	const struct json_str mode[] = {{ frame + 10, 2 }, { frame + 12, 3 }};
+	const struct json_array jar_names = {
+		.value = names, .count = 3, .type = t_to_strn };
+	const struct json_array jar_mode = {
+		.value = mode, .count = 2, .type = t_to_valuen };
+
+	const struct json_kv jkv[] = {
+		{ .key = "temperature", .key_len = 4, .value = &temp, .type = t_to_strn, },
+		{ JSON_KEY("raw"), .value = &raw, .type = t_to_valuen, },
+		{ JSON_KEY("names"), .value = &jar_names, .type = t_to_array, },
+		{ .key = "mode", .value = &jar_mode, .type = t_to_array, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_template(void)
+{
+	char *expected = "{\"id\": 7, \"pos\": {\"x\": -3, \"on\": false}, "
+	                  "\"name\": \"abcd\", \"hist\": [1, 2, 3, 4]}";
+	char *test = "test_json_template";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	char gen[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	int id = 1;
+	int x = 2;
+	bool on = true;
+	char name[5] = "ab";
+	int hist[] = {1, 2, 3, 4};
+	struct json_array jar_hist = { .value = hist, .count = 2,
+		.type = t_to_integer };
+	const struct json_kv pos[] = {
+		{ .key = "x",  .value = &x,  .type = t_to_integer, },
+		{ .key = "on", .value = &on, .type = t_to_boolean, },
+		{ NULL },
+	};
+	const struct json_kv jkv[] = {
+		{ .key = "id",   .value = &id,       .type = t_to_integer, },
+		{ .key = "pos",  .value = pos,       .type = t_to_object, },
+		{ .key = "name", .value = name,      .type = t_to_string, },
+		{ .key = "hist", .value = &jar_hist, .type = t_to_array, },
+		{ NULL },
+	};
+
+	struct mtojson_ctx ctx = {0};
+	char skel[64];
+	struct json_slot slots[5];
+	struct json_template tpl = { .skel = skel, .skel_len = sizeof(skel),
+		.slots = slots, .max_slots = 4 };
+
+	// One slot short
+	if (json_template_compile(&ctx, &tpl, jkv) || ctx.error != e_json_no_space){
+		fprintf(stderr, "%s: %s\n", test, "compiled with too few slots");
+		return 1;
+	}
+
+	tpl.max_slots = 5;
+	tpl.skel_len = sizeof(skel);
+	if (json_template_compile(&ctx, &tpl, jkv) != strlen(skel)
+	    || tpl.count != 5){
+		fprintf(stderr, "%s: %s\n", test, "compile failed");
+		return 1;
+	}
+
+	// Values are read on every render, a shorter buffer fails
+	id = 7;
+	x = -3;
+	on = false;
+	strcpy(name, "abcd");
+	jar_hist.count = 4;
+	if (json_template_render(&ctx, &tpl, result, len - 1)
+	    || ctx.error != e_json_no_space){
+		fprintf(stderr, "%s: %s\n", test, "rendered to short buffer");
+		return 1;
+	}
+	if (json_template_render(&ctx, &tpl, result, len) != len - 1)
+		return 1;
+
+	// Nothing but the values changed, the result is the same as without
+	generate_json(gen, jkv, len);
+	if (strcmp(gen, result)){
+		fprintf(stderr, "%s: %s\n", test, gen);
+		return 1;
+	}
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_template_pretty(void)
+{
+	char *expected = "{\n"
+	                  "  \"pos\": {\n"
+	                  "    \"x\": 1,\n"
+	                  "    \"arr\": [\n"
+	                  "      1,\n"
+	                  "      2\n"
+	                  "    ]\n"
+	                  "  },\n"
+	                  "  \"objs\": [\n"
+	                  "    {\n"
+	                  "      \"id\": 1\n"
+	                  "    },\n"
+	                  "    {}\n"
+	                  "  ]\n"
+	                  "}";
+	char *test = "test_json_template_pretty";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	char gen[len];
+	memset(result, '\0', len);
+	rp = result;
+	tell_single_test(test);
+
+	int x = 1;
+	int arr[] = {1, 2};
+	struct json_array jar_arr = { .value = arr, .count = 2,
+		.type = t_to_integer };
+	const struct json_kv pos[] = {
+		{ .key = "x",   .value = &x,       .type = t_to_integer, },
+		{ .key = "arr", .value = &jar_arr, .type = t_to_array, },
+		{ NULL },
+	};
+	const struct json_kv obj[] = {
+		{ .key = "id", .value = &x, .type = t_to_integer, },
+		{ NULL },
+	};
+	const struct json_kv empty[] = {{ NULL }};
+	const struct json_kv *objs[] = { obj, empty };
+	struct json_array jar_objs = { .value = objs, .count = 2,
+		.type = t_to_object };
+	const struct json_kv jkv[] = {
+		{ .key = "pos",  .value = pos,       .type = t_to_object, },
+		{ .key = "objs", .value = &jar_objs, .type = t_to_array, },
+		{ NULL },
+	};
+
+	struct mtojson_ctx ctx = {0};
+	ctx.indent = 2;
+	char skel[128];
+	struct json_slot slots[3];
+	struct json_template tpl = { .skel = skel, .skel_len = sizeof(skel),
+		.slots = slots, .max_slots = 3 };
+
+	// Slots are indented as deep as they are nested
+	if (!json_template_compile(&ctx, &tpl, jkv)
+	    || json_template_render(&ctx, &tpl, result, len) != len - 1)
+		return 1;
+	if (generate_json_r(&ctx, gen, jkv, len) != len - 1 || strcmp(gen, result)){
+		fprintf(stderr, "%s: %s\n", test, gen);
+		return 1;
+	}
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_patch(void)
+{
+#ifndef JSON_DOUBLE_DECIMALS
+	char *expected = "{\"seq\": 4294967295, \"t\": -40   , \"ok\": true , "
+	                  "\"v\": 0.5                      , \"tag\": \"x\"}";
+#else
+	char expected[128], v_json[32];
+	fixed_double(v_json, 0.5);
+	sprintf(expected, "{\"seq\": 4294967295, \"t\": -40   , \"ok\": true , "
+	                  "\"v\": %-25s, \"tag\": \"x\"}", v_json);
+#endif
+	char *test = "test_json_patch";
+	char result[128];
+	memset(result, '\0', sizeof(result));
+	rp = result;
+
+	uint32_t seq = 1;
+	int16_t t = 20;
+	bool ok = false;
+	double v = -1e-300;
+	const struct json_kv jkv[] = {
+		{ .key = "seq", .value = &seq, .type = t_to_uint32, },
+		{ .key = "t",   .value = &t,   .type = t_to_int16, },
+		{ .key = "ok",  .value = &ok,  .type = t_to_boolean, },
+		{ .key = "v",   .value = &v,   .type = t_to_double, },
+		{ .key = "tag", .value = "x",  .type = t_to_string, },
+		{ NULL },
+	};
+
+	struct mtojson_ctx ctx = {0};
+	char skel[64];
+	struct json_slot slots[5];
+	struct json_patch_slot ps[5];
+	struct json_template tpl = { .skel = skel, .skel_len = sizeof(skel),
+		.slots = slots, .max_slots = 5 };
+
+	if (!json_template_compile(&ctx, &tpl, jkv)
+	    || json_template_render_fixed(&ctx, &tpl, result, sizeof(result), ps)
+	       != strlen(expected)){
+		fprintf(stderr, "%s: %s\n", test, result);
+		return 1;
+	}
+
+	seq = UINT32_MAX;
+	t = -40;
+	ok = true;
+	v = 0.5;
+	for (int i = 0; i < 4; i++)
+		if (json_patch(result, &ps[i], slots[i].value))
+			return 1;
+	if (!json_patch(result, &ps[4], "y")){
+		fprintf(stderr, "%s: %s\n", test, "patched a string");
+		return 1;
+	}
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_escape(void)
+{
+	char *expected = "{\"quote\": \"say \\\"hi\\\"\", \"path\": \"C:\\\\tmp\", "
+	                  "\"ctrl\": \"\\b\\t\\n\\f\\r\\u0001\\u001f\x7f\", "
+	                  "\"nul\": \"a\\u0000b\", "
+	                  "\"long\": [\"0123456789abcdef0123456789abcde\\\"\", "
+	                  "\"0123456789abcdef\\n0123456789abcdef\", "
+	                  "\"\\\\0123456789abcdef0123456789abcdef\"], "
+	                  "\"utf8\": \"\xc3\xa4\xe2\x82\xac\"}";
+	char *test = "test_json_escape";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	const struct json_str nul = { "a\0b", 3 };
+	const char *strings[] = {
+		"0123456789abcdef0123456789abcde\"",
+		"0123456789abcdef\n0123456789abcdef",
+		"\\0123456789abcdef0123456789abcdef",
+	};
+	const struct json_array jar_strings = {
+		.value = strings, .count = 3, .type = t_to_string };
+
+	const struct json_kv jkv[] = {
+		{ .key = "quote", .value = "say \"hi\"", .type = t_to_string, },
+		{ .key = "path",  .value = "C:\\tmp", .type = t_to_string, },
+		{ .key = "ctrl",  .value = "\b\t\n\f\r\x01\x1f\x7f", .type = t_to_string, },
+		{ .key = "nul",   .value = &nul, .type = t_to_strn, },
+		{ .key = "long",  .value = &jar_strings, .type = t_to_array, },
+		{ .key = "utf8",  .value = "\xc3\xa4\xe2\x82\xac", .type = t_to_string, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_compact(void)
+{
+	char *expected = "{\"a\":[1,-2,3],\"o\":{\"b\":true,\"s\":[\"x\",\"y\"]},"
+	                  "\"e\":[],\"n\":[{},{\"c\":0}]}";
+	char *test = "test_json_compact";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+	tell_single_test(test);
+
+	const int a[] = {1, -2, 3};
+	const bool b = true;
+	const char *str[] = {"x", "y"};
+	const int c = 0;
+	const struct json_array jar_a = { .value = a, .count = 3, .type = t_to_integer };
+	const struct json_array jar_s = { .value = str, .count = 2, .type = t_to_string };
+	const struct json_array jar_e = { .value = a, .count = 0, .type = t_to_integer };
+	const struct json_kv o[] = {
+		{ .key = "b", .value = &b, .type = t_to_boolean, },
+		{ .key = "s", .value = &jar_s, .type = t_to_array, },
+		{ NULL },
+	};
+	const struct json_kv empty[] = {{ NULL }};
+	const struct json_kv oc[] = {
+		{ .key = "c", .value = &c, .type = t_to_integer, },
+		{ NULL },
+	};
+	const void *objs[] = {empty, oc};
+	const struct json_array jar_n = { .value = objs, .count = 2, .type = t_to_object };
+	const struct json_kv jkv[] = {
+		{ .key = "a", .value = &jar_a, .type = t_to_array, },
+		{ .key = "o", .value = o, .type = t_to_object, },
+		{ .key = "e", .value = &jar_e, .type = t_to_array, },
+		{ .key = "n", .value = &jar_n, .type = t_to_array, },
+		{ NULL },
+	};
+
+	struct mtojson_ctx ctx = {0};
+	ctx.compact = 1;
+	if (json_measure_r(&ctx, jkv) != len
+	    || generate_json_r(&ctx, result, jkv, len) != len - 1)
+		return 1;
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_pretty(void)
+{
+	char *expected = "{\n"
+	                  "  \"a\": [\n"
+	                  "    1,\n"
+	                  "    -2\n"
+	                  "  ],\n"
+	                  "  \"o\": {\n"
+	                  "    \"s\": \"x\",\n"
+	                  "    \"e\": []\n"
+	                  "  },\n"
+	                  "  \"n\": {}\n"
+	                  "}";
+	char *test = "test_json_pretty";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+	tell_single_test(test);
+
+	const int a[] = {1, -2};
+	const struct json_array jar_a = { .value = a, .count = 2, .type = t_to_integer };
+	const struct json_array jar_n = { .value = a, .count = 0, .type = t_to_integer };
+	const struct json_kv empty[] = {{ NULL }};
+	const struct json_kv o[] = {
+		{ .key = "s", .value = "x", .type = t_to_string, },
+		{ .key = "e", .value = &jar_n, .type = t_to_array, },
+		{ NULL },
+	};
+	const struct json_kv jkv[] = {
+		{ .key = "a", .value = &jar_a, .type = t_to_array, },
+		{ .key = "o", .value = o, .type = t_to_object, },
+		{ .key = "n", .value = empty, .type = t_to_object, },
+		{ NULL },
+	};
+
+	struct mtojson_ctx ctx = {0};
+	ctx.indent = 2;
+	if (json_measure_r(&ctx, jkv) != len
+	    || generate_json_r(&ctx, result, jkv, len) != len - 1)
+		return 1;
+	if (check_result(test, expected, result))
+		return 1;
+
+	// Indentation wider than a piece, generated byte by byte
+	char *wide = "{\n"
+	             "                    \"o\": {\n"
+	             "                                        \"e\": []\n"
+	             "                    }\n"
+	             "}";
+	const struct json_kv wide_o[] = {
+		{ .key = "e", .value = &jar_n, .type = t_to_array, },
+		{ NULL },
+	};
+	const struct json_kv wide_kv[] = {
+		{ .key = "o", .value = wide_o, .type = t_to_object, },
+		{ NULL },
+	};
+	char piece[128];
+	size_t l = 0;
+	ctx.indent = 20;
+	json_gen_begin(&ctx, wide_kv);
+	while (l < sizeof(piece) - 1 && json_gen_next(&ctx, piece + l, 1) == 1)
+		l++;
+	piece[l] = '\0';
+	return check_result(test, wide, piece);
+}
+
+static int
+test_json_batch(void)
+{
+	char *ndjson = "{\"seq\": 0}\n{\"seq\": 1}\n{\"seq\": 2}\n";
+	char *array = "[{\"seq\": 0}, {\"seq\": 1}, {\"seq\": 2}]";
+	char *test = "test_json_batch";
+	char result[64];
+	memset(result, '\0', sizeof(result));
+	rp = result;
+	tell_single_test(test);
+
+	const int seq[] = {0, 1, 2};
+	const struct json_kv r0[] = {
+		{ .key = "seq", .value = &seq[0], .type = t_to_integer, }, { NULL } };
+	const struct json_kv r1[] = {
+		{ .key = "seq", .value = &seq[1], .type = t_to_integer, }, { NULL } };
+	const struct json_kv r2[] = {
+		{ .key = "seq", .value = &seq[2], .type = t_to_integer, }, { NULL } };
+	const struct json_kv *const records[] = {r0, r1, r2};
+
+	size_t len = strlen(ndjson) + 1;
+	if (generate_json_batch(result, records, 3, len, m_json_ndjson) != 3
+	    || check_result(test, ndjson, result))
+		return 1;
+
+	// A record that doesn't fit is left out as a whole
+	if (generate_json_batch(result, records, 3, len - 1, m_json_ndjson) != 2
+	    || strlen(result) != 22)
+		return 1;
+
+	// Every record stays on a line of its own, the option is kept
+	struct mtojson_ctx ctx = {0};
+	ctx.indent = 2;
+	if (generate_json_batch_r(&ctx, result, records, 3, strlen(ndjson) + 1,
+	                          m_json_ndjson) != 3
+	    || check_result(test, ndjson, result) || ctx.indent != 2)
+		return 1;
+
+	len = strlen(array) + 1;
+	if (generate_json_batch(result, records, 3, len - 1, m_json_array) != 2
+	    || strcmp(result, "[{\"seq\": 0}, {\"seq\": 1}]"))
+		return 1;
+	if (generate_json_batch(result, records, 3, 3, m_json_array) != 0
+	    || strcmp(result, "[]")
+	    || generate_json_batch(result, records, 3, 2, m_json_array) != 0)
+		return 1;
+	if (generate_json_batch(result, records, 3, len, m_json_array) != 3)
+		return 1;
+	return check_result(test, array, result);
+}
+
+static int
+test_json_iov(void)
+{
+	char *test = "test_json_iov";
+	char blob[200];
+	char expected[256];
+	char result[256];
+	memset(result, '\0', sizeof(result));
+	rp = result;
+	tell_single_test(test);
+
+	memset(blob, 'A', sizeof(blob) - 1);
+	blob[sizeof(blob) - 1] = '\0';
+	const int id = 42;
+	const struct json_kv jkv[] = {
+		{ .key = "id",   .value = &id,  .type = t_to_integer, },
+		{ .key = "blob", .value = blob, .type = t_to_string, },
+		{ .key = "raw",  .value = "[1, 2]", .type = t_to_value, },
+		{ NULL },
+	};
+	generate_json(expected, jkv, sizeof(expected));
+
+	struct mtojson_ctx ctx = {0};
+	char scratch[48];
+	struct json_iovec iov[4];
+	size_t n = generate_json_iov(&ctx, jkv, scratch, sizeof(scratch), iov, 4, 64);
+
+	// The blob is referenced, everything else is copied to scratch
+	if (n != 3 || iov[1].iov_base != blob || ctx.total != strlen(expected))
+		return 1;
+	size_t l = 0;
+	for (size_t i = 0; i < n; i++){
+		memcpy(result + l, iov[i].iov_base, iov[i].iov_len);
+		l += iov[i].iov_len;
+	}
+	if (check_result(test, expected, result))
+		return 1;
+
+	if (generate_json_iov(&ctx, jkv, scratch, sizeof(scratch), iov, 2, 64)
+	    || ctx.error != e_json_no_space
+	    || generate_json_iov(&ctx, jkv, scratch, 8, iov, 4, 64)
+	    || ctx.error != e_json_no_space)
+		return 1;
+	return 0;
+}
+
+static int
+test_json_binary(void)
+{
+	char *expected = "{\"b64\": [\"\", \"Zg==\", \"Zm8=\", \"Zm9v\", \"Zm9vYmFy\"], "
+	                  "\"long\": \"AAMGCQwPEhUYGx4hJCcqLTAzNjk8P0JFSEtOUVRXWl1gY2Zp"
+	                  "bG9ydXh7foGEh4qNkJOWmZyfoqWoq66xtLe6vcDDxg==\", "
+	                  "\"hex\": \"000306090c0f1215181b1e2124272a2d303336393c3f42"
+	                  "45484b4e5154575a5d606366696c6f7275787b7e8184878a8d9093"
+	                  "96999c9fa2a5a8abaeb1b4b7babdc0c3c6\", \"short\": \"ff00\"}";
+	char *test = "test_json_binary";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	uint8_t data[67];
+	for (int i = 0; i < 67; i++)
+		data[i] = (uint8_t)(3 * i);
+	const uint8_t ff00[] = {0xFF, 0x00};
+	const struct json_bin foobar[] = {{ "foobar", 0 }, { "foobar", 1 },
+		{ "foobar", 2 }, { "foobar", 3 }, { "foobar", 6 }};
+	const struct json_bin bin = { data, sizeof(data) };
+	const struct json_bin short_bin = { ff00, sizeof(ff00) };
+	const struct json_array jar_b64 = {
+		.value = foobar, .count = 5, .type = t_to_base64 };
+
+	const struct json_kv jkv[] = {
+		{ .key = "b64",   .value = &jar_b64,   .type = t_to_array, },
+		{ .key = "long",  .value = &bin,       .type = t_to_base64, },
+		{ .key = "hex",   .value = &bin,       .type = t_to_hex, },
+		{ .key = "short", .value = &short_bin, .type = t_to_hex, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	return check_result(test, expected, result);
+}
+
+static int
+test_json_array_types(void)
+{
+	char *expected = "{\"u\": [0, 4294967295, 10], \"b\": [true, false, true], "
+	                  "\"v\": [null, {\"x\": 1}, 2.5], \"vn\": [12, 3], "
+	                  "\"s\": [\"plain\", \"tab\\there\", \"\"], \"sn\": [\"ab\", \"c\"]}";
+	char *test = "test_json_array_types";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+
+	const unsigned u[] = {0, UINT_MAX, 10};
+	const bool b[] = {true, false, true};
+	const char *v[] = {"null", "{\"x\": 1}", "2.5"};
+	const struct json_str vn[] = {{ "123", 2 }, { "3", 1 }};
+	const char *str[] = {"plain", "tab\there", ""};
+	const struct json_str sn[] = {{ "abc", 2 }, { "c", 1 }};
+	const struct json_array jar_u = { .value = u, .count = 3, .type = t_to_uinteger };
+	const struct json_array jar_b = { .value = b, .count = 3, .type = t_to_boolean };
+	const struct json_array jar_v = { .value = v, .count = 3, .type = t_to_value };
+	const struct json_array jar_vn = { .value = vn, .count = 2, .type = t_to_valuen };
+	const struct json_array jar_s = { .value = str, .count = 3, .type = t_to_string };
+	const struct json_array jar_sn = { .value = sn, .count = 2, .type = t_to_strn };
+
+	const struct json_kv jkv[] = {
+		{ .key = "u",  .value = &jar_u,  .type = t_to_array, },
+		{ .key = "b",  .value = &jar_b,  .type = t_to_array, },
+		{ .key = "v",  .value = &jar_v,  .type = t_to_array, },
+		{ .key = "vn", .value = &jar_vn, .type = t_to_array, },
+		{ .key = "s",  .value = &jar_s,  .type = t_to_array, },
+		{ .key = "sn", .value = &jar_sn, .type = t_to_array, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	return check_result(test, expected, result);
+}
+
+#ifdef MTOJSON_STATS
+static char hook_trace[16];
+
+static void
+trace_hook(struct mtojson_ctx *ctx, enum json_value_type type, int depth,
+		_Bool end)
+{
+	char *p = ctx->user;
+	p += strlen(p);
+	*p++ = type == t_to_object ? (end ? 'O' : 'o') : (end ? 'A' : 'a');
+	*p = (char)('0' + depth);
+}
+#endif
+
+#if defined(MTOJSON_STATS) && defined(MTOJSON_THREADS)
+struct hook_count {
+	pthread_mutex_t lock;
+	size_t n;
+};
+
+// Called by all threads of generate_json_parallel()
+static void
+count_hook(struct mtojson_ctx *ctx, enum json_value_type type, int depth,
+		_Bool end)
+{
+	struct hook_count *hc = ctx->user;
+
+	(void)type;
+	(void)depth;
+	(void)end;
+	pthread_mutex_lock(&hc->lock);
+	hc->n++;
+	pthread_mutex_unlock(&hc->lock);
+}
+#endif
+
+static int
+test_json_stats(void)
+{
+	char *test = "test_json_stats";
+	tell_single_test(test);
+#ifdef MTOJSON_STATS
+	char *expected = "{\"n\": 12, \"s\": \"ab\", \"a\": [1, 22], \"o\": {\"b\": true}}";
+	char result[64];
+	struct mtojson_ctx ctx = {0};
+	struct json_stats stats;
+
+	const int n = 12;
+	const int a[] = {1, 22};
+	const bool b = true;
+	const struct json_array jar = { .value = a, .count = 2, .type = t_to_integer };
+	const struct json_kv o[] = {
+		{ .key = "b", .value = &b, .type = t_to_boolean, },
+		{ NULL },
+	};
+	const struct json_kv jkv[] = {
+		{ .key = "n", .value = &n,   .type = t_to_integer, },
+		{ .key = "s", .value = "ab", .type = t_to_string, },
+		{ .key = "a", .value = &jar, .type = t_to_array, },
+		{ .key = "o", .value = o,    .type = t_to_object, },
+		{ NULL },
+	};
+
+	memset(hook_trace, '\0', sizeof(hook_trace));
+	ctx.user = hook_trace;
+	ctx.hook = trace_hook;
+	size_t len = generate_json_r(&ctx, result, jkv, sizeof(result));
+	if (check_result(test, expected, result) || strcmp(hook_trace, "o1a2A2o2O2O1"))
+		return 1;
+
+	stats = ctx.stats;
+	if (stats.bytes[t_to_integer] != 5 || stats.bytes[t_to_string] != 4
+	    || stats.bytes[t_to_boolean] != 4 || stats.bytes[t_to_array] != 4
+	    || stats.bytes[t_to_object] != len - 17
+	    || stats.fields != 7 || stats.peak_depth != 2)
+		return 1;
+
+	// Every output counts the same
+	ctx.hook = NULL;
+	if (json_measure_r(&ctx, jkv) != len + 1
+	    || memcmp(&stats, &ctx.stats, sizeof(stats)))
+		return 1;
+	json_gen_begin(&ctx, jkv);
+	while (json_gen_next(&ctx, result, 3) == 3)
+		;
+	if (ctx.error || memcmp(&stats, &ctx.stats, sizeof(stats)))
+		return 1;
+
+	// Out of space after the first member
+	if (generate_json_r(&ctx, result, jkv, 10)
+	    || ctx.error != e_json_no_space || ctx.stats.fail_offset != 8)
+		return 1;
+	if (generate_json_r(&ctx, result, jkv, len)
+	    || ctx.stats.fail_offset != len)
+		return 1;
+#endif
+	return 0;
+}
+
+static int
+test_json_parallel(void)
+{
+	char *test = "test_json_parallel";
+	tell_single_test(test);
+#ifdef MTOJSON_THREADS
+	enum { N = 40000, M = 20000 };
+	static int ints[N];
+	static struct json_kv objs[M][3];
+	static const struct json_kv *pobjs[M];
+	static struct json_worker workers[8];
+	struct mtojson_ctx ctx = {0};
+	const bool odd = true, even = false;
+
+	for (int i = 0; i < N; i++)
+		ints[i] = i * 37 - N;
+	for (int i = 0; i < M; i++){
+		objs[i][0] = (struct json_kv){ .key = "i", .value = &ints[i],
+			.type = t_to_integer };
+		objs[i][1] = (struct json_kv){ .key = "odd",
+			.value = i % 2 ? &odd : &even, .type = t_to_boolean };
+		pobjs[i] = objs[i];
+	}
+	const struct json_array jar_ints = { .value = ints, .count = N, .type = t_to_integer };
+	const struct json_array jar_objs = { .value = pobjs, .count = M, .type = t_to_object };
+	const struct json_kv jkv[] = {
+		{ .key = "ints", .value = &jar_ints, .type = t_to_array, },
+		{ .key = "objs", .value = &jar_objs, .type = t_to_array, },
+		{ NULL },
+	};
+
+	size_t len = json_measure(jkv);
+	char *expected = malloc(len);
+	char *result = malloc(len);
+	int rv = 1;
+	if (!expected || !result || generate_json(expected, jkv, len) != len - 1)
+		goto out;
+
+	for (unsigned n = 1; n <= 8; n += 3){
+		memset(result, '\0', len);
+		if (generate_json_parallel(&ctx, result, jkv, len, workers, n) != len - 1
+		    || check_result(test, expected, result))
+			goto out;
+		if (generate_json_parallel(&ctx, result, jkv, len - 1, workers, n)
+		    || ctx.error != e_json_no_space)
+			goto out;
+	}
+	ctx.compact = 1;
+	len = generate_json_r(&ctx, expected, jkv, len);
+	if (!len || generate_json_parallel(&ctx, result, jkv, len + 1, workers, 8) != len)
+		goto out;
+	if (check_result(test, expected, result))
+		goto out;
+
+#ifdef MTOJSON_STATS
+	// The chunks add up to the same statistics and hooks as serially
+	static struct hook_count hc = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	static struct json_stats stats;
+	static size_t hooks;
+	ctx.user = &hc;
+	ctx.hook = count_hook;
+	generate_json_r(&ctx, expected, jkv, len + 1);
+	stats = ctx.stats;
+	hooks = hc.n;
+	hc.n = 0;
+	generate_json_parallel(&ctx, result, jkv, len + 1, workers, 8);
+	ctx.hook = NULL;
+	if (hc.n != hooks || memcmp(&ctx.stats, &stats, sizeof(stats))){
+		fprintf(stderr, "%s: hooks %zu/%zu, fields %zu/%zu\n", test, hc.n,
+				hooks, ctx.stats.fields, stats.fields);
+		goto out;
+	}
+#endif
+	rv = 0;
+out:
+	free(expected);
+	free(result);
+	return rv;
+#else
+	return 0;
+#endif
+}
+
+static int
+test_json_parallel_cache(void)
+{
+	char *test = "test_json_parallel_cache";
+	tell_single_test(test);
+#ifdef MTOJSON_THREADS
+	enum { M = 20000 };
+	static struct json_kv objs[M][3];
+	static const struct json_kv *pobjs[M];
+	static struct json_worker workers[8];
+	static int ints[M];
+	struct mtojson_ctx ctx = {0};
+	unsigned gen = 0;
+	char store[32];
+	const int k = 1;
+	const struct json_kv shared[] = {
+		{ .key = "k", .value = &k, .type = t_to_integer, },
+		{ NULL },
+	};
+	struct json_cache cache = { .value = shared, .type = t_to_object,
+		.gen = &gen, .buf = store, .size = sizeof(store) };
+
+	// One cache in every element of all chunks
+	for (int i = 0; i < M; i++){
+		ints[i] = i;
+		objs[i][0] = (struct json_kv){ .key = "i", .value = &ints[i],
+			.type = t_to_integer };
+		objs[i][1] = (struct json_kv){ .key = "c", .value = &cache,
+			.type = t_to_cached };
+		pobjs[i] = objs[i];
+	}
+	const struct json_array jar_objs = { .value = pobjs, .count = M, .type = t_to_object };
+	const struct json_kv jkv[] = {
+		{ .key = "objs", .value = &jar_objs, .type = t_to_array, },
+		{ NULL },
+	};
+
+	size_t len = json_measure(jkv);
+	char *expected = malloc(len);
+	char *result = malloc(len);
+	int rv = 1;
+	if (!expected || !result)
+		goto out;
+
+	// The threads only read the cache, it is filled serially
+	if (generate_json_parallel(&ctx, result, jkv, len, workers, 8) != len - 1
+	    || cache.len)
+		goto out;
+	if (generate_json(expected, jkv, len) != len - 1 || !cache.len
+	    || check_result(test, expected, result))
+		goto out;
+	memset(result, '\0', len);
+	if (generate_json_parallel(&ctx, result, jkv, len, workers, 8) != len - 1)
+		goto out;
+	rv = check_result(test, expected, result);
+out:
+	free(expected);
+	free(result);
+	return rv;
+#else
+	return 0;
+#endif
+}
+
+static int
+test_json_builder(void)
+{
+#ifndef JSON_DOUBLE_DECIMALS
+	char *expected = "{\"id\": -5, \"seq\": 18446744073709551615, \"ok\": true, "
+	                  "\"name\": \"a\\\"b\", \"pi\": 3.5, \"tags\": [1, 2, 3], "
+	                  "\"child\": {\"n\": 7}}";
+#else
+	char expected[160], pi_json[32];
+	fixed_double(pi_json, 3.5);
+	sprintf(expected, "{\"id\": -5, \"seq\": 18446744073709551615, \"ok\": true, "
+	                  "\"name\": \"a\\\"b\", \"pi\": %s, \"tags\": [1, 2, 3], "
+	                  "\"child\": {\"n\": 7}}", pi_json);
+#endif
+	char *test = "test_json_builder";
+	char result[160];
+	char name[] = "a\"b";
+	uint64_t arena[128];
+	struct json_builder b;
+	tell_single_test(test);
+
+	const int tags[] = {1, 2, 3};
+	json_builder_init(&b, arena, sizeof(arena));
+	for (int pass = 0; pass < 2; pass++){
+		json_builder_reset(&b);
+		struct json_obj *obj = json_obj_new(&b, 7);
+		struct json_obj *child = json_obj_new(&b, 1);
+		if (!obj || !child
+		    || json_obj_add_int(&b, obj, "id", -5)
+		    || json_obj_add_uint(&b, obj, "seq", UINT64_MAX)
+		    || json_obj_add_bool(&b, obj, "ok", 1)
+		    || json_obj_add_string(&b, obj, "name", name)
+		    || json_obj_add_double(&b, obj, "pi", 3.5)
+		    || json_obj_add_array(&b, obj, "tags", tags, 3, t_to_integer)
+		    || json_obj_add_int(&b, child, "n", 7)
+		    || json_obj_add_obj(obj, "child", child))
+			return 1;
+
+		// Full objects stay as they are
+		if (!json_obj_add_int(&b, child, "m", 8) || !json_obj_add_obj(child, "c", obj))
+			return 1;
+		name[0] = 'x'; // Strings are copied
+		generate_json(result, obj->kv, sizeof(result));
+		name[0] = 'a';
+		if (check_result(test, expected, result))
+			return 1;
+	}
+
+	// Out of arena
+	json_builder_init(&b, arena, sizeof(struct json_obj) + 2 * sizeof(struct json_kv));
+	struct json_obj *obj = json_obj_new(&b, 1);
+	if (!obj || !json_obj_add_int(&b, obj, "n", 1) || json_obj_new(&b, 0)
+	    || json_obj_add(obj, "n", t_to_value, "1"))
+		return 1;
+	generate_json(result, obj->kv, sizeof(result));
+	return check_result(test, "{\"n\": 1}", result);
+}
+
+static int
+test_json_flatten(void)
+{
+	char *test = "test_json_flatten";
+	char expected[256];
+	char result[256];
+	uint64_t arena[128];
+	struct json_builder b;
+	struct mtojson_ctx ctx = {0};
+	tell_single_test(test);
+
+	int n = 1;
+	const bool t = true;
+	const uint8_t u8 = 200;
+	const struct json_str sn = { "abc", 2 };
+	const int ints[] = {1, 2};
+	const struct json_kv o1[] = {
+		{ .key = "n", .value = &n, .type = t_to_integer, }, { NULL } };
+	const struct json_kv o2[] = {
+		{ .key = "t", .value = &t, .type = t_to_boolean, }, { NULL } };
+	const struct json_kv *objs[] = {o1, o2};
+	const struct json_array jar_objs = { .value = objs, .count = 2, .type = t_to_object };
+	const struct json_array jar_ints = { .value = ints, .count = 2, .type = t_to_integer };
+	const struct json_array jar_empty = { .value = objs, .count = 0, .type = t_to_object };
+	const struct json_array *arrays[] = {&jar_ints, &jar_objs, &jar_empty};
+	const struct json_array jar_arrays = { .value = arrays, .count = 3, .type = t_to_array };
+	const struct json_kv inner[] = {
+		{ .key = "u8", .value = &u8, .type = t_to_uint8, },
+		{ .key = "ints", .value = &jar_ints, .type = t_to_array, },
+		{ NULL },
+	};
+	const struct json_kv jkv[] = {
+		{ .key = "s", .value = "str", .type = t_to_string, },
+		{ .key = "sn", .value = &sn, .type = t_to_strn, },
+		{ .key = "inner", .value = inner, .type = t_to_object, },
+		{ .key = "arrays", .value = &jar_arrays, .type = t_to_array, },
+		{ .key = "n", .value = &n, .type = t_to_integer, },
+		{ NULL },
+	};
+
+	json_builder_init(&b, arena, sizeof(arena));
+	const struct json_kv *flat = json_flatten(&ctx, &b, jkv);
+	if (!flat || !generate_json(expected, jkv, sizeof(expected)))
+		return 1;
+
+	// Numbers are copied
+	n = 2;
+	generate_json(result, flat, sizeof(result));
+	n = 1;
+	if (check_result(test, expected, result))
+		return 1;
+
+	json_builder_init(&b, arena, b.used - 1);
+	if (json_flatten(&ctx, &b, jkv) || ctx.error != e_json_no_space)
+		return 1;
+	return 0;
+}
+
+static int
+test_json_optional(void)
+{
+	char *expected = "{\"b\": null, \"nulls\": [null, null]}";
+	char *test = "test_json_optional";
+	size_t len = strlen(expected) + 1;
+	char result[64];
+	memset(result, '\0', sizeof(result));
+	rp = result;
+	tell_single_test(test);
+
+	bool has_a = false, has_b = true, has_c = false;
+	const int a = 1, c = 3;
+	const struct json_array jar_nulls = { .value = NULL, .count = 2, .type = t_to_null };
+	const struct json_kv jkv[] = {
+		{ .key = "a", .value = &a, .type = t_to_integer, .present = &has_a, },
+		{ .key = "b", .type = t_to_null, .present = &has_b, },
+		{ .key = "nulls", .value = &jar_nulls, .type = t_to_array, },
+		{ .key = "c", .value = &c, .type = t_to_integer, .present = &has_c, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	if (check_result(test, expected, result))
+		return 1;
+
+	// The same table every time, only the flags change
+	has_a = has_c = true;
+	has_b = false;
+	generate_json(result, jkv, sizeof(result));
+	if (check_result(test, "{\"a\": 1, \"nulls\": [null, null], \"c\": 3}", result))
+		return 1;
+
+	const struct json_kv none[] = {
+		{ .key = "b", .type = t_to_null, .present = &has_b, },
+		{ NULL },
+	};
+	struct mtojson_ctx ctx = {0};
+	ctx.indent = 2;
+	generate_json_r(&ctx, result, none, sizeof(result));
+	if (check_result(test, "{}", result))
+		return 1;
+	has_b = true;
+	generate_json_r(&ctx, result, none, sizeof(result));
+	return check_result(test, "{\n  \"b\": null\n}", result);
+}
+
+struct test_pos {
+	int16_t x, y;
+};
+
+struct test_rec {
+	uint32_t id;
+	bool ok;
+	char name[8];
+	double t;
+	struct test_pos pos;
+};
+
+static int
+test_json_struct(void)
+{
+#ifndef JSON_DOUBLE_DECIMALS
+	char *expected = "{\"recs\": [{\"id\": 1, \"ok\": true, \"name\": \"one\", \"t\": 0.5}, "
+	                  "{\"id\": 2, \"ok\": false, \"name\": \"t\\\"wo\", \"t\": -1}], "
+	                  "\"pos\": {\"x\": -3, \"y\": 4}}";
+#else
+	char expected[256], t0[32], t1[32];
+	fixed_double(t0, 0.5);
+	fixed_double(t1, -1);
+	sprintf(expected, "{\"recs\": [{\"id\": 1, \"ok\": true, \"name\": \"one\", \"t\": %s}, "
+	                  "{\"id\": 2, \"ok\": false, \"name\": \"t\\\"wo\", \"t\": %s}], "
+	                  "\"pos\": {\"x\": -3, \"y\": 4}}", t0, t1);
+#endif
+	char *test = "test_json_struct";
+	size_t len = strlen(expected) + 1;
+	char result[len];
+	memset(result, '\0', len);
+	rp = result;
+	tell_single_test(test);
+
+	const struct json_field pos_fields[] = {
+		{ JSON_FIELD(struct test_pos, x, t_to_int16), },
+		{ JSON_FIELD(struct test_pos, y, t_to_int16), },
+		{ NULL },
+	};
+	const struct json_field rec_fields[] = {
+		{ JSON_FIELD(struct test_rec, id, t_to_uint32), },
+		{ JSON_FIELD(struct test_rec, ok, t_to_boolean), },
+		{ JSON_FIELD(struct test_rec, name, t_to_string), },
+		{ JSON_FIELD(struct test_rec, t, t_to_double), },
+		{ NULL },
+	};
+	struct test_rec recs[] = {
+		{ .id = 1, .ok = true, .name = "one", .t = 0.5, .pos = { 5, 6 } },
+		{ .id = 2, .ok = false, .name = "t\"wo", .t = -1, .pos = { -3, 4 } },
+	};
+
+	const struct json_struct js_recs = { .fields = rec_fields, .base = recs,
+		.stride = sizeof(recs[0]) };
+	const struct json_struct js_pos = { .fields = pos_fields, .base = &recs[1].pos };
+	const struct json_array jar_recs = { .value = &js_recs, .count = 2, .type = t_to_struct };
+	const struct json_kv jkv[] = {
+		{ .key = "recs", .value = &jar_recs, .type = t_to_array, },
+		{ .key = "pos", .value = &js_pos, .type = t_to_struct, },
+		{ NULL },
+	};
+	run_test(test, result, jkv, len, 0);
+	if (check_result(test, expected, result))
+		return 1;
+
+	// A struct in a struct, read straight from the changed records
+	const struct json_field nested_fields[] = {
+		{ JSON_FIELD(struct test_rec, id, t_to_uint32), },
+		{ JSON_FIELD(struct test_rec, pos, t_to_struct), .fields = pos_fields, },
+		{ NULL },
+	};
+	const struct json_struct js_nested = { .fields = nested_fields, .base = &recs[0] };
+	const struct json_kv nested[] = {
+		{ .key = "rec", .value = &js_nested, .type = t_to_struct, },
+		{ NULL },
+	};
+	char buf[64];
+	recs[0].id = 7;
+	size_t l = generate_json(buf, nested, sizeof(buf));
+#if defined(MAX_NESTED_OBJECT_DEPTH) && MAX_NESTED_OBJECT_DEPTH < 2
+	return l != 0;
+#else
+	return !l || check_result(test, "{\"rec\": {\"id\": 7, \"pos\": {\"x\": 5, \"y\": 6}}}", buf);
+#endif
+}
+
+static int
+test_json_cache(void)
+{
+	char *test = "test_json_cache";
+	char result[96];
+	rp = result;
+	tell_single_test(test);
+
+	int port = 80;
+	unsigned gen = 0;
+	char store[32];
+	const struct json_kv net[] = {
+		{ .key = "port", .value = &port, .type = t_to_integer, },
+		{ .key = "host", .value = "a", .type = t_to_string, },
+		{ NULL },
+	};
+	struct json_cache cache = { .value = net, .type = t_to_object, .gen = &gen,
+		.buf = store, .size = sizeof(store) };
+	const struct json_kv jkv[] = {
+		{ .key = "net", .value = &cache, .type = t_to_cached, },
+		{ NULL },
+	};
+
+	if (!generate_json(result, jkv, sizeof(result))
+	    || check_result(test, "{\"net\": {\"port\": 80, \"host\": \"a\"}}", result)
+	    || cache.len != 25 || memcmp(store, result + 8, 25))
+		return 1;
+
+	// Unchanged generation, the old JSON is copied
+	port = 8080;
+	if (!generate_json(result, jkv, sizeof(result))
+	    || check_result(test, "{\"net\": {\"port\": 80, \"host\": \"a\"}}", result)
+	    || json_measure(jkv) != strlen(result) + 1)
+		return 1;
+
+	gen++;
+	if (!generate_json(result, jkv, sizeof(result))
+	    || check_result(test, "{\"net\": {\"port\": 8080, \"host\": \"a\"}}", result))
+		return 1;
+
+	// Other output options need the value generated again
+	struct mtojson_ctx ctx = {0};
+	ctx.compact = 1;
+	if (!generate_json_r(&ctx, result, jkv, sizeof(result))
+	    || check_result(test, "{\"net\":{\"port\":8080,\"host\":\"a\"}}", result)
+	    || !cache.compact)
+		return 1;
+
+	// Caches that are too small are generated every time
+	cache.size = 8;
+	gen++;
+	port = 1;
+	if (!generate_json_r(&ctx, result, jkv, sizeof(result))
+	    || check_result(test, "{\"net\":{\"port\":1,\"host\":\"a\"}}", result))
+		return 1;
+	return cache.len != 0;
+}
+
+static int
+exec_test(int i)
+{
+	switch (i){
+	case 1:
+		return test_json_integer();
+		break;
+	case 2:
+		return test_json_integer_two();
+		break;
+	case 3:
+		return test_json_string();
+		break;
+	case 4:
+		return test_json_boolean();
+		break;
+	case 5:
+		return test_json_valuetype();
+		break;
+	case 6:
+		return test_json_array_integer();
+		break;
+	case 7:
+		return test_json_array_boolean();
+		break;
+	case 8:
+		return test_json_array_string();
+		break;
+	case 9:
+		return test_json_array_array();
+		break;
+	case 10:
+		return test_json_array_empty();
+		break;
+	case 11:
+		return test_json_array_empty_one();
+		break;
+	case 12:
+		return test_json_object();
+		break;
+	case 13:
+		return test_json_array_object();
+		break;
+	case 14:
+		return test_json_object_empty();
+		break;
+	case 15:
+#ifdef MAX_NESTED_OBJECT_DEPTH
+		if (MAX_NESTED_OBJECT_DEPTH < 2)
+			return test_json_object_object(1);
+#endif
+		return test_json_object_object(0);
+		break;
+	case 16:
+#ifdef MAX_NESTED_OBJECT_DEPTH
+		if (MAX_NESTED_OBJECT_DEPTH < 3)
+			return test_json_object_nested_empty(1);
+#endif
+		return test_json_object_nested_empty(0);
+		break;
+	case 17:
+		return test_json_uinteger();
+		break;
+	case 18:
+		return test_json_int_max();
+		break;
+	case 19:
+		return test_json_int_min();
+		break;
+	case 20:
+		return test_json_uint_max();
+		break;
+	case 21:
+		return test_json_reentrant();
+		break;
+	case 22:
+		return test_json_stream();
+		break;
+	case 23:
+		return test_json_resumable();
+		break;
+	case 24:
+		return test_json_nesting_depth();
+		break;
+	case 25:
+		return test_json_integer_digits();
+		break;
+	case 26:
+		return test_json_fixed_width();
+		break;
+	case 27:
+		return test_json_double();
+		break;
+	case 28:
+		return test_json_counted_string();
+		break;
+	case 29:
+		return test_json_template();
+		break;
+	case 30:
+		return test_json_patch();
+		break;
+	case 31:
+		return test_json_escape();
+		break;
+	case 32:
+		return test_json_compact();
+		break;
+	case 33:
+		return test_json_pretty();
+		break;
+	case 34:
+		return test_json_batch();
+		break;
+	case 35:
+		return test_json_iov();
+		break;
+	case 36:
+		return test_json_binary();
+		break;
+	case 37:
+		return test_json_array_types();
+		break;
+	case 38:
+		return test_json_stats();
+		break;
+	case 39:
+		return test_json_parallel();
+		break;
+	case 40:
+		return test_json_builder();
+		break;
+	case 41:
+		return test_json_flatten();
+		break;
+	case 42:
+		return test_json_optional();
+		break;
+	case 43:
+		return test_json_struct();
+		break;
+	case 44:
+		return test_json_cache();
+		break;
+	case 45:
+		return test_json_template_pretty();
+		break;
+	case 46:
+		return test_json_parallel_cache();
 		break;
 	default:
 		fputs("No such test!\n", stderr);
@@ -712,7 +2365,7 @@ exec_test(int i)
 	}
 	return 1;
 }
-#define MAXTEST 20
+#define MAXTEST 46
 
 int
 main(int argc, char *argv[])